@@ -0,0 +1,83 @@
+#include "../cppflag.hpp"
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Compares the vectorized token classifier with the scalar path on argv
+// entries carrying long values, and times a full Parse over the same argv.
+// Build with -DCPPFLAG_SIMD_CLASSIFY to enable the vectorized classifier;
+// without it both rows measure the scalar path.
+int main(int argc, char **argv) {
+  cli::FlagSet opts("classify_bench", "Benchmark for argv token classification");
+  auto tokensFlag = opts.Int("tokens", 100000, "argv size", 'n');
+  auto valueFlag = opts.Int("value_len", 256, "bytes per flag value", 'v');
+  auto repsFlag = opts.Int("reps", 20, "repetitions", 'r');
+  cli::ParseResult pr = opts.Parse(argc, argv);
+  if (pr.kind == cli::ParseErrorKind::HelpRequested) {
+    opts.PrintUsage(std::cout);
+    return 0;
+  }
+  if (!pr) {
+    opts.PrintError(pr, std::cerr);
+    std::cerr << "\n";
+    return 2;
+  }
+
+  int64_t n = tokensFlag->As<int64_t>();
+  std::string value(static_cast<size_t>(valueFlag->As<int64_t>()), 'x');
+  std::vector<std::string> args{"bench"};
+  for (int64_t i = 0; i < n; ++i) {
+    args.push_back(i % 2 ? "--payload=" + value : value);
+  }
+  std::vector<char *> av;
+  for (auto &a : args) {
+    av.push_back(&a[0]);
+  }
+
+  auto time_it = [&](auto fn) {
+    double best = 1e30;
+    for (int64_t r = 0; r < repsFlag->As<int64_t>(); ++r) {
+      auto t0 = std::chrono::steady_clock::now();
+      fn();
+      auto t1 = std::chrono::steady_clock::now();
+      best = std::min(best, std::chrono::duration<double>(t1 - t0).count());
+    }
+    return best * 1e9 / n;
+  };
+
+  uint64_t sink = 0;
+  double scalar = time_it([&] {
+    for (size_t i = 1; i < av.size(); ++i) {
+      auto d = cli::detail::ClassifyTokenScalar(av[i]);
+      sink += d.len + d.eq + d.dashes;
+    }
+  });
+  double vector = time_it([&] {
+    for (size_t i = 1; i < av.size(); ++i) {
+      auto d = cli::detail::ClassifyToken(av[i]);
+      sink += d.len + d.eq + d.dashes;
+    }
+  });
+
+  cli::FlagSet fs("bench");
+  fs.String("payload", "", "payload");
+  double parse = time_it([&] {
+    cli::ParseResult res = fs.Parse(static_cast<int>(av.size()), av.data());
+    sink += res.ok();
+  });
+
+#if !defined(CPPFLAG_CLASSIFY_VECTOR)
+  const char *isa = "scalar";
+#elif defined(__AVX2__)
+  const char *isa = "AVX2";
+#else
+  const char *isa = "SSE2";
+#endif
+  std::cout << "tokens " << n << ", value bytes " << value.size() << "\n";
+  std::cout << "classify scalar   " << scalar << " ns/token\n";
+  std::cout << "classify " << isa << (isa[0] == 's' ? "   " : "     ")
+            << vector << " ns/token\n";
+  std::cout << "full Parse        " << parse << " ns/token\n";
+  return sink == 0 ? 1 : 0;
+}
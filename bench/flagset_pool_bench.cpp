@@ -0,0 +1,86 @@
+#include "../cppflag.hpp"
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Handles a stream of short commands the way an embedded command server
+// does, once building a FlagSet per command and once leasing it from a
+// FlagSetPool, and reports the cost per command of each.
+
+namespace {
+
+void DefineFlags(cli::FlagSet &fs) {
+  fs.Int("id", 0, "request id");
+  fs.Int("timeout_ms", 1000, "timeout", 't');
+  fs.Int("retries", 3, "retries", 'r');
+  fs.Float("ratio", 1.0, "ratio");
+  fs.Bool("verbose", false, "verbose", 'v');
+  fs.Bool("dry_run", false, "dry run", 'n');
+  fs.String("user", "", "user", 'u');
+  fs.String("mode", "fast", "mode", 'm');
+  fs.String("region", "local", "region");
+  fs.StringSet("tags", "", "tags");
+  fs.Args("[command:string] [targets:string...]");
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  cli::FlagSet opts("flagset_pool_bench", "Benchmark for FlagSetPool");
+  auto commandsFlag = opts.Int("commands", 200000, "commands per run", 'c');
+  cli::ParseResult pr = opts.Parse(argc, argv);
+  if (pr.kind == cli::ParseErrorKind::HelpRequested) {
+    opts.PrintUsage(std::cout);
+    return 0;
+  }
+  if (!pr) {
+    opts.PrintError(pr, std::cerr);
+    std::cerr << "\n";
+    return 2;
+  }
+
+  std::vector<std::vector<std::string>> commands = {
+      {"srv", "--id=1", "-u", "alice", "get", "k1"},
+      {"srv", "--id=2", "-v", "--tags=a,b", "put", "k2", "k3"},
+      {"srv", "-t", "250", "--mode=slow", "scan"},
+      {"srv", "--id=4", "-n", "--region=eu", "delete", "k4"},
+  };
+  std::vector<std::vector<char *>> argvs;
+  for (auto &cmd : commands) {
+    argvs.emplace_back();
+    for (auto &arg : cmd) {
+      argvs.back().push_back(&arg[0]);
+    }
+  }
+  int64_t n = commandsFlag->As<int64_t>();
+  uint64_t sink = 0;
+
+  auto time_it = [&](auto handle) {
+    auto t0 = std::chrono::steady_clock::now();
+    for (int64_t i = 0; i < n; ++i) {
+      auto &av = argvs[static_cast<size_t>(i) % argvs.size()];
+      handle(static_cast<int>(av.size()), av.data());
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(t1 - t0).count() / n;
+  };
+
+  double constructed = time_it([&](int ac, char **av) {
+    cli::FlagSet fs("srv");
+    DefineFlags(fs);
+    sink += fs.Parse(ac, av).ok() + fs.PositionalViews().size();
+  });
+
+  cli::FlagSetPool pool("srv", "", DefineFlags);
+  double pooled = time_it([&](int ac, char **av) {
+    cli::FlagSetPool::Lease fs = pool.Acquire();
+    sink += fs->Parse(ac, av).ok() + fs->PositionalViews().size();
+  });
+
+  std::cout << "commands " << n << "\n";
+  std::cout << "construct per command  " << constructed << " ns\n";
+  std::cout << "pooled                 " << pooled << " ns  ("
+            << constructed / pooled << "x)\n";
+  return sink == 0 ? 1 : 0;
+}
@@ -0,0 +1,131 @@
+#include "../cppflag.hpp"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Times IpRangeListValue::contains on a large generated range list against
+// std::upper_bound over the same merged intervals.
+int main(int argc, char **argv) {
+  cli::FlagSet opts("iprange_bench", "Benchmark for IP range list lookups");
+  auto rangesFlag = opts.Int("ranges", 100000, "CIDR entries to generate", 'n');
+  auto queriesFlag = opts.Int("queries", 2000000, "lookups per run", 'q');
+  cli::ParseResult pr = opts.Parse(argc, argv);
+  if (pr.kind == cli::ParseErrorKind::HelpRequested) {
+    opts.PrintUsage(std::cout);
+    return 0;
+  }
+  if (!pr) {
+    opts.PrintError(pr, std::cerr);
+    std::cerr << "\n";
+    return 2;
+  }
+
+  std::mt19937 rng(7);
+  auto v4 = [&](uint32_t a) {
+    return std::to_string(a >> 24) + "." + std::to_string((a >> 16) & 255) +
+           "." + std::to_string((a >> 8) & 255) + "." + std::to_string(a & 255);
+  };
+  std::string text;
+  int64_t n = rangesFlag->As<int64_t>();
+  for (int64_t i = 0; i < n; ++i) {
+    if (i % 10 == 9) {
+      char buf[64];
+      std::snprintf(buf, sizeof(buf), "2001:db8:%x:%x::/64",
+                    static_cast<unsigned>(rng() & 0xffff),
+                    static_cast<unsigned>(rng() & 0xffff));
+      text += buf;
+    } else {
+      text += v4(rng()) + "/" + std::to_string(16 + rng() % 17);
+    }
+    text += ',';
+  }
+
+  cli::FlagSet fs("bench");
+  auto flag = fs.IpRangeList("deny", "", "ranges to deny");
+  std::string arg = "--deny=" + text;
+  char *av[] = {const_cast<char *>("bench"), &arg[0]};
+  auto t0 = std::chrono::steady_clock::now();
+  pr = fs.Parse(2, av);
+  auto t1 = std::chrono::steady_clock::now();
+  if (!pr) {
+    std::cerr << pr.message << "\n";
+    return 1;
+  }
+  const auto &list = flag->As<cli::IpRangeListValue>();
+
+  // the same merged IPv4 intervals for the std::upper_bound baseline
+  std::vector<std::pair<uint32_t, uint32_t>> intervals;
+  std::string merged = list.ToString();
+  for (size_t pos = 0; pos < merged.size();) {
+    size_t comma = std::min(merged.find(',', pos), merged.size());
+    std::string item = merged.substr(pos, comma - pos);
+    pos = comma + 1;
+    size_t dash = item.find('-');
+    uint32_t lo, hi;
+    if (cli::IpRangeListValue::ParseV4(item.substr(0, dash), lo)) {
+      hi = lo;
+      if (dash != std::string::npos) {
+        cli::IpRangeListValue::ParseV4(item.substr(dash + 1), hi);
+      }
+      intervals.emplace_back(lo, hi);
+    }
+  }
+
+  std::vector<uint32_t> queries(static_cast<size_t>(queriesFlag->As<int64_t>()));
+  for (auto &q : queries) {
+    q = rng();
+  }
+  std::vector<cli::IpRangeListValue::V6> queries6(queries.size());
+  for (auto &q : queries6) {
+    q = {0x20010db800000000ull | (rng() & 0xffff) << 16 | (rng() & 0xffff),
+         uint64_t(rng()) << 32 | rng()};
+  }
+
+  auto time_it = [&](auto fn) {
+    auto start = std::chrono::steady_clock::now();
+    size_t hits = fn();
+    double ns = std::chrono::duration<double, std::nano>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+    return std::make_pair(ns / queries.size(), hits);
+  };
+  auto branchless = time_it([&] {
+    size_t hits = 0;
+    for (uint32_t q : queries) {
+      hits += list.contains(q);
+    }
+    return hits;
+  });
+  auto baseline = time_it([&] {
+    size_t hits = 0;
+    for (uint32_t q : queries) {
+      auto it = std::upper_bound(
+          intervals.begin(), intervals.end(), q,
+          [](uint32_t x, const auto &r) { return x < r.first; });
+      hits += it != intervals.begin() && q <= std::prev(it)->second;
+    }
+    return hits;
+  });
+  auto v6 = time_it([&] {
+    size_t hits = 0;
+    for (const auto &q : queries6) {
+      hits += list.contains(q);
+    }
+    return hits;
+  });
+
+  std::cout << "entries " << n << ", merged ranges " << list.size()
+            << ", parse " << std::chrono::duration<double, std::milli>(t1 - t0)
+                                 .count()
+            << " ms\n";
+  std::cout << "ipv4 branchless   " << branchless.first << " ns/lookup ("
+            << branchless.second << " hits)\n";
+  std::cout << "ipv4 upper_bound  " << baseline.first << " ns/lookup ("
+            << baseline.second << " hits)\n";
+  std::cout << "ipv6 branchless   " << v6.first << " ns/lookup (" << v6.second
+            << " hits)\n";
+  return branchless.second == baseline.second ? 0 : 3;
+}
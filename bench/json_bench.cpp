@@ -0,0 +1,90 @@
+#include "../cppflag.hpp"
+#include <chrono>
+#include <iostream>
+#include <string>
+
+// Parses a generated routing table through a Json flag and reports the cost
+// of each stage: validation during Parse, the tape build on first access,
+// and member lookups through the view afterwards.
+
+namespace {
+
+std::string RoutingTable(int routes) {
+  std::string doc = "{\"version\": 3, \"routes\": [";
+  for (int i = 0; i < routes; ++i) {
+    if (i > 0) {
+      doc += ", ";
+    }
+    doc += "{\"prefix\": \"/api/v" + std::to_string(i % 7) + "/svc" +
+           std::to_string(i) + "\", \"backend\": \"pool-" +
+           std::to_string(i % 13) + ".internal:8443\", \"weight\": " +
+           std::to_string(i % 100) + ".5, \"retry\": {\"max\": " +
+           std::to_string(i % 5) + ", \"on\": [\"5xx\", \"reset\"]}, " +
+           "\"canary\": " + (i % 3 ? "false" : "true") + "}";
+  }
+  return doc + "]}";
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  cli::FlagSet opts("json_bench", "Benchmark for Json flags");
+  auto routesFlag = opts.Int("routes", 20000, "routes in the document", 'r');
+  auto rounds = opts.Int("rounds", 20, "parses to average over", 'n');
+  cli::ParseResult pr = opts.Parse(argc, argv);
+  if (pr.kind == cli::ParseErrorKind::HelpRequested) {
+    opts.PrintUsage(std::cout);
+    return 0;
+  }
+  if (!pr) {
+    opts.PrintError(pr, std::cerr);
+    std::cerr << "\n";
+    return 2;
+  }
+
+  std::string arg =
+      "--routes=" + RoutingTable(static_cast<int>(routesFlag->As<int64_t>()));
+  char *av[] = {const_cast<char *>("svc"), &arg[0]};
+  size_t bytes = arg.size() - 9;
+  int64_t n = rounds->As<int64_t>();
+
+  cli::FlagSet fs("svc");
+  const cli::Flag *routes = fs.Json("routes", "{}", "routing table");
+  double parse_ns = 0, tape_ns = 0;
+  double weight = 0;
+  for (int64_t r = 0; r < n; ++r) {
+    auto t0 = std::chrono::steady_clock::now();
+    if (!fs.Parse(2, av)) {
+      std::cerr << "parse failed\n";
+      return 1;
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    cli::JsonValue::View root = routes->As<cli::JsonValue>().root();
+    auto t2 = std::chrono::steady_clock::now();
+    weight += root["routes"][0]["weight"].as_double();
+    parse_ns += std::chrono::duration<double, std::nano>(t1 - t0).count();
+    tape_ns += std::chrono::duration<double, std::nano>(t2 - t1).count();
+  }
+
+  // walk every route as a request router would
+  cli::JsonValue::View list = routes->As<cli::JsonValue>().root()["routes"];
+  auto t0 = std::chrono::steady_clock::now();
+  int64_t retries = 0;
+  size_t lookups = 0;
+  for (cli::JsonValue::View route : list) {
+    retries += route["retry"]["max"].as_int64();
+    weight += route["weight"].as_double();
+    lookups += 3;
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  double walk_ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+
+  std::cout << "document " << bytes << " bytes, " << list.size()
+            << " routes\n";
+  std::cout << "validate (Parse)    " << parse_ns / n / 1e3 << " us  ("
+            << bytes * n / parse_ns << " GB/s)\n";
+  std::cout << "tape on first use   " << tape_ns / n / 1e3 << " us  ("
+            << bytes * n / tape_ns << " GB/s)\n";
+  std::cout << "member lookup       " << walk_ns / lookups << " ns\n";
+  return retries + weight > 0 ? 0 : 1;
+}
@@ -0,0 +1,424 @@
+#include "../cppflag.hpp"
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+// Compares candidate structures for FlagSet::index_ on generated flag names,
+// reporting ns per lookup plus cache misses and branch mispredictions per
+// lookup when hardware counters are available.
+
+namespace {
+
+using Value = const void *;
+
+// HwCounters reads cache misses and branch misses through perf_event_open.
+// When the kernel or the sandbox refuses, it reports itself unavailable and
+// the benchmark prints timings only.
+class HwCounters {
+public:
+  HwCounters() {
+#if defined(__linux__)
+    fds_[0] = Open(PERF_COUNT_HW_CACHE_MISSES);
+    fds_[1] = Open(PERF_COUNT_HW_BRANCH_MISSES);
+#endif
+  }
+  ~HwCounters() {
+#if defined(__linux__)
+    for (int fd : fds_) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+#endif
+  }
+  bool available() const { return fds_[0] >= 0 || fds_[1] >= 0; }
+  void Start() {
+#if defined(__linux__)
+    for (int fd : fds_) {
+      if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+#endif
+  }
+  // Stop returns the counts since Start, or -1 for a counter that is missing.
+  void Stop(int64_t &cache_misses, int64_t &branch_misses) {
+    int64_t out[2] = {-1, -1};
+#if defined(__linux__)
+    for (int i = 0; i < 2; ++i) {
+      if (fds_[i] >= 0) {
+        ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t v;
+        if (read(fds_[i], &v, sizeof(v)) == sizeof(v)) {
+          out[i] = static_cast<int64_t>(v);
+        }
+      }
+    }
+#endif
+    cache_misses = out[0];
+    branch_misses = out[1];
+  }
+
+private:
+#if defined(__linux__)
+  static int Open(uint64_t config) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+  }
+#endif
+  int fds_[2] = {-1, -1};
+};
+
+// names shaped like real flags: module prefixes shared by many flags, a few
+// underscore-separated words, lengths from about 8 to 50 bytes
+std::vector<std::string> GenerateNames(size_t n, std::mt19937_64 &rng) {
+  static const char *modules[] = {"server",  "storage", "rpc_client",
+                                  "cache",   "log",     "auth",
+                                  "metrics", "db_pool", "http2"};
+  static const char *words[] = {"max",     "min",   "timeout", "retry",
+                                "buffer",  "size",  "enable",  "threads",
+                                "ms",      "bytes", "queue",   "depth",
+                                "backoff", "path",  "level",   "interval"};
+  std::vector<std::string> names;
+  std::unordered_map<std::string, bool> seen;
+  while (names.size() < n) {
+    std::string name = modules[rng() % 9];
+    int parts = 1 + static_cast<int>(rng() % 4);
+    for (int i = 0; i < parts; ++i) {
+      name += '_';
+      name += words[rng() % 16];
+    }
+    if (rng() % 3 == 0) {
+      name += '_' + std::to_string(rng() % 100);
+    }
+    if (seen.emplace(name, true).second) {
+      names.push_back(name);
+    }
+  }
+  return names;
+}
+
+struct UnorderedIndex {
+  std::unordered_map<std::string_view, Value> map;
+  explicit UnorderedIndex(const std::vector<std::string> &names) {
+    for (auto &n : names) {
+      map[n] = &n;
+    }
+  }
+  Value Find(std::string_view key) const {
+    auto it = map.find(key);
+    return it == map.end() ? nullptr : it->second;
+  }
+};
+
+struct SortedArrayIndex {
+  std::vector<std::pair<std::string_view, Value>> items;
+  explicit SortedArrayIndex(const std::vector<std::string> &names) {
+    for (auto &n : names) {
+      items.emplace_back(n, &n);
+    }
+    std::sort(items.begin(), items.end());
+  }
+  Value Find(std::string_view key) const {
+    auto it = std::lower_bound(
+        items.begin(), items.end(), key,
+        [](const auto &item, std::string_view k) { return item.first < k; });
+    return it != items.end() && it->first == key ? it->second : nullptr;
+  }
+};
+
+// RadixTrie is a path-compressed trie; children are kept sorted by their
+// first byte and searched linearly, which is fast for small fan-out.
+struct RadixTrie {
+  struct Node {
+    std::string label;
+    Value value = nullptr;
+    std::vector<std::unique_ptr<Node>> children;
+  };
+  Node root;
+  explicit RadixTrie(const std::vector<std::string> &names) {
+    for (auto &n : names) {
+      Insert(n, &n);
+    }
+  }
+  void Insert(std::string_view key, Value v) {
+    Node *node = &root;
+    while (true) {
+      if (key.empty()) {
+        node->value = v;
+        return;
+      }
+      Node *next = nullptr;
+      for (auto &c : node->children) {
+        if (c->label[0] == key[0]) {
+          next = c.get();
+          break;
+        }
+      }
+      if (!next) {
+        auto leaf = std::make_unique<Node>();
+        leaf->label = key;
+        leaf->value = v;
+        node->children.push_back(std::move(leaf));
+        std::sort(node->children.begin(), node->children.end(),
+                  [](const auto &a, const auto &b) {
+                    return a->label[0] < b->label[0];
+                  });
+        return;
+      }
+      size_t common = 0;
+      while (common < next->label.size() && common < key.size() &&
+             next->label[common] == key[common]) {
+        ++common;
+      }
+      if (common < next->label.size()) {
+        // split next at the common prefix
+        auto tail = std::make_unique<Node>();
+        tail->label = next->label.substr(common);
+        tail->value = next->value;
+        tail->children = std::move(next->children);
+        next->label.resize(common);
+        next->value = nullptr;
+        next->children.clear();
+        next->children.push_back(std::move(tail));
+      }
+      key.remove_prefix(common);
+      node = next;
+    }
+  }
+  Value Find(std::string_view key) const {
+    const Node *node = &root;
+    while (!key.empty()) {
+      const Node *next = nullptr;
+      for (const auto &c : node->children) {
+        if (c->label[0] == key[0]) {
+          next = c.get();
+          break;
+        }
+      }
+      if (!next || key.compare(0, next->label.size(), next->label) != 0) {
+        return nullptr;
+      }
+      key.remove_prefix(next->label.size());
+      node = next;
+    }
+    return node->value;
+  }
+};
+
+// FlatMap is an open-addressing table with linear probing and an 8-bit hash
+// tag per slot kept in a separate array for cheap probing.
+struct FlatMap {
+  std::vector<uint8_t> tags; // 0 means empty
+  std::vector<std::pair<std::string_view, Value>> slots;
+  size_t mask;
+  explicit FlatMap(const std::vector<std::string> &names) {
+    size_t cap = 16;
+    while (cap < names.size() * 2) {
+      cap <<= 1;
+    }
+    mask = cap - 1;
+    tags.assign(cap, 0);
+    slots.resize(cap);
+    for (auto &n : names) {
+      uint64_t h = cli::detail::HashBytes(n);
+      size_t i = h & mask;
+      while (tags[i]) {
+        i = (i + 1) & mask;
+      }
+      tags[i] = Tag(h);
+      slots[i] = {n, &n};
+    }
+  }
+  static uint8_t Tag(uint64_t h) { return static_cast<uint8_t>(h >> 56) | 1; }
+  Value Find(std::string_view key) const {
+    uint64_t h = cli::detail::HashBytes(key);
+    uint8_t tag = Tag(h);
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+      if (tags[i] == 0) {
+        return nullptr;
+      }
+      if (tags[i] == tag && slots[i].first == key) {
+        return slots[i].second;
+      }
+    }
+  }
+};
+
+// PerfectHash uses hash-and-displace: keys are grouped into buckets, and
+// each bucket gets a seed that sends all of its keys to free slots. A lookup
+// is two hashes, one seed read and one key comparison.
+struct PerfectHash {
+  std::vector<uint32_t> seeds;
+  std::vector<std::pair<std::string_view, Value>> slots;
+  explicit PerfectHash(const std::vector<std::string> &names) {
+    size_t nb = std::max<size_t>(1, names.size() / 4);
+    size_t ns = names.size() + names.size() / 4 + 1;
+    seeds.assign(nb, 0);
+    slots.assign(ns, {std::string_view(), nullptr});
+    std::vector<std::vector<const std::string *>> buckets(nb);
+    for (auto &n : names) {
+      buckets[cli::detail::HashBytes(n) % nb].push_back(&n);
+    }
+    std::vector<size_t> order(nb);
+    for (size_t i = 0; i < nb; ++i) {
+      order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return buckets[a].size() > buckets[b].size();
+    });
+    std::vector<bool> used(ns, false);
+    for (size_t b : order) {
+      if (buckets[b].empty()) {
+        continue;
+      }
+      for (uint32_t seed = 1;; ++seed) {
+        std::vector<size_t> picked;
+        bool ok = true;
+        for (auto *n : buckets[b]) {
+          size_t s = cli::detail::HashBytes(*n, seed) % ns;
+          if (used[s] ||
+              std::find(picked.begin(), picked.end(), s) != picked.end()) {
+            ok = false;
+            break;
+          }
+          picked.push_back(s);
+        }
+        if (ok) {
+          seeds[b] = seed;
+          for (size_t k = 0; k < picked.size(); ++k) {
+            used[picked[k]] = true;
+            slots[picked[k]] = {*buckets[b][k], buckets[b][k]};
+          }
+          break;
+        }
+      }
+    }
+  }
+  Value Find(std::string_view key) const {
+    uint32_t seed = seeds[cli::detail::HashBytes(key) % seeds.size()];
+    const auto &slot = slots[cli::detail::HashBytes(key, seed) % slots.size()];
+    return slot.first == key ? slot.second : nullptr;
+  }
+};
+
+template <typename Index>
+void Run(const char *label, const Index &index,
+         const std::vector<std::string_view> &queries, int64_t reps,
+         HwCounters &hw) {
+  size_t found = 0;
+  int64_t cache = 0, branch = 0;
+  double best = 1e30;
+  for (int64_t r = 0; r < reps; ++r) {
+    hw.Start();
+    auto t0 = std::chrono::steady_clock::now();
+    for (auto q : queries) {
+      found += index.Find(q) != nullptr;
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    int64_t c, b;
+    hw.Stop(c, b);
+    double secs = std::chrono::duration<double>(t1 - t0).count();
+    if (secs < best) {
+      best = secs;
+      cache = c;
+      branch = b;
+    }
+  }
+  double n = static_cast<double>(queries.size());
+  std::cout << "  " << std::left << std::setw(16) << label << std::right
+            << std::fixed << std::setprecision(2) << std::setw(9)
+            << best * 1e9 / n << " ns";
+  if (cache >= 0) {
+    std::cout << std::setw(10) << cache / n << " cache-miss";
+  } else {
+    std::cout << std::setw(21) << "n/a";
+  }
+  if (branch >= 0) {
+    std::cout << std::setw(10) << branch / n << " branch-miss";
+  } else {
+    std::cout << std::setw(22) << "n/a";
+  }
+  std::cout << (found == 0 ? "  (no hits?)" : "") << "\n";
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  cli::FlagSet opts("lookup_bench", "Compares flag index structures");
+  auto sizesFlag = opts.String("sizes", "32,512,5000", "flag counts to test");
+  auto queriesFlag = opts.Int("queries", 1000000, "lookups per run", 'q');
+  auto missFlag = opts.Int("miss_percent", 10, "percent of unknown names");
+  auto repsFlag = opts.Int("reps", 5, "runs per structure, best is kept");
+  cli::ParseResult pr = opts.Parse(argc, argv);
+  if (pr.kind == cli::ParseErrorKind::HelpRequested) {
+    opts.PrintUsage(std::cout);
+    return 0;
+  }
+  if (!pr) {
+    opts.PrintError(pr, std::cerr);
+    std::cerr << "\n";
+    return 2;
+  }
+
+  HwCounters hw;
+  if (!hw.available()) {
+    std::cout << "hardware counters unavailable, reporting timings only\n";
+  }
+
+  std::mt19937_64 rng(42);
+  std::string sizes = sizesFlag->As<std::string>();
+  for (size_t pos = 0; pos < sizes.size();) {
+    size_t comma = std::min(sizes.find(',', pos), sizes.size());
+    size_t n = std::stoul(sizes.substr(pos, comma - pos));
+    pos = comma + 1;
+
+    std::vector<std::string> names = GenerateNames(n, rng);
+    std::vector<std::string> misses = GenerateNames(n + n / 2 + 1, rng);
+    UnorderedIndex known(names);
+    misses.erase(std::remove_if(misses.begin(), misses.end(),
+                                [&](const std::string &m) {
+                                  return known.Find(m) != nullptr;
+                                }),
+                 misses.end());
+    std::vector<std::string_view> queries;
+    for (int64_t i = 0; i < queriesFlag->As<int64_t>(); ++i) {
+      if (static_cast<int64_t>(rng() % 100) < missFlag->As<int64_t>()) {
+        queries.push_back(misses[rng() % misses.size()]);
+      } else {
+        queries.push_back(names[rng() % names.size()]);
+      }
+    }
+    size_t total = 0;
+    for (auto &s : names) {
+      total += s.size();
+    }
+    std::cout << n << " flags, mean name length " << total / n << "\n";
+    int64_t reps = repsFlag->As<int64_t>();
+    Run("unordered_map", UnorderedIndex(names), queries, reps, hw);
+    Run("sorted array", SortedArrayIndex(names), queries, reps, hw);
+    Run("radix trie", RadixTrie(names), queries, reps, hw);
+    Run("flat map", FlatMap(names), queries, reps, hw);
+    Run("perfect hash", PerfectHash(names), queries, reps, hw);
+  }
+  return 0;
+}
@@ -0,0 +1,101 @@
+#include "../cppflag.hpp"
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Builds one large argument vector of --id=... entries, short flags and
+// positionals, then times Parse against ParseParallel at increasing thread
+// counts and checks that both produce the same result.
+int main(int argc, char **argv) {
+  cli::FlagSet opts("parallel_parse_bench",
+                    "Scaling benchmark for FlagSet::ParseParallel");
+  auto tokensFlag = opts.Int("tokens", 2000000, "argv size", 'n');
+  auto threadsFlag = opts.Int("max_threads", 0, "0 means one per core", 't');
+  auto repsFlag = opts.Int("reps", 5, "repetitions per configuration", 'r');
+  cli::ParseResult pr = opts.Parse(argc, argv);
+  if (pr.kind == cli::ParseErrorKind::HelpRequested) {
+    opts.PrintUsage(std::cout);
+    return 0;
+  }
+  if (!pr) {
+    opts.PrintError(pr, std::cerr);
+    std::cerr << "\n";
+    return 2;
+  }
+
+  int64_t n = tokensFlag->As<int64_t>();
+  std::vector<std::string> args{"bench"};
+  args.reserve(n + 1);
+  for (int64_t i = 0; i < n; ++i) {
+    switch (i % 4) {
+    case 0:
+      args.push_back("--id=" + std::to_string(i));
+      break;
+    case 1:
+      args.push_back("item" + std::to_string(i));
+      break;
+    case 2:
+      args.push_back("-w" + std::to_string(i % 97));
+      break;
+    default:
+      args.push_back("--ratio=" + std::to_string(i) + ".5");
+      break;
+    }
+  }
+  std::vector<char *> av;
+  for (auto &a : args) {
+    av.push_back(&a[0]);
+  }
+
+  auto define = [](cli::FlagSet &fs) {
+    fs.Int("id", 0, "id");
+    fs.Int("weight", 0, "weight", 'w');
+    fs.Float("ratio", 0, "ratio");
+  };
+  auto time_parse = [&](unsigned threads, cli::FlagSet &fs) {
+    double best = 1e30;
+    for (int64_t r = 0; r < repsFlag->As<int64_t>(); ++r) {
+      auto t0 = std::chrono::steady_clock::now();
+      cli::ParseResult res =
+          threads == 0 ? fs.Parse(static_cast<int>(av.size()), av.data())
+                       : fs.ParseParallel(static_cast<int>(av.size()),
+                                          av.data(), threads);
+      auto t1 = std::chrono::steady_clock::now();
+      if (!res) {
+        std::cerr << "parse failed: " << res.message << "\n";
+        std::exit(1);
+      }
+      best = std::min(best, std::chrono::duration<double>(t1 - t0).count());
+    }
+    return best;
+  };
+
+  cli::FlagSet seq("seq");
+  define(seq);
+  double base = time_parse(0, seq);
+  std::cout << "tokens " << n << "\n";
+  std::cout << "sequential      " << base * 1e3 << " ms\n";
+
+  unsigned max_threads = static_cast<unsigned>(threadsFlag->As<int64_t>());
+  if (max_threads == 0) {
+    max_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (unsigned t = 1; t <= max_threads; t *= 2) {
+    cli::FlagSet par("par");
+    define(par);
+    double secs = time_parse(t, par);
+    bool same = par.PositionalViews() == seq.PositionalViews();
+    for (auto name : {"id", "weight", "ratio"}) {
+      same = same && par.Lookup(name)->value->ToString() ==
+                         seq.Lookup(name)->value->ToString();
+    }
+    std::cout << "threads " << t << (t < 10 ? "       " : "      ")
+              << secs * 1e3 << " ms  speedup " << base / secs
+              << (same ? "" : "  RESULT MISMATCH") << "\n";
+    if (!same) {
+      return 3;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,120 @@
+#include "../cppflag.hpp"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Parses a pool of distinct command lines over and over, drawn at random, as
+// a command interpreter would. It reports per-call latency without a cache,
+// with a parse cache large enough for the pool (the hit path), and with a
+// cache half the size of the pool.
+
+namespace {
+
+void DefineFlags(cli::FlagSet &fs) {
+  fs.Int("port", 8080, "port", 'p');
+  fs.Int("timeout_ms", 1000, "timeout");
+  fs.Float("ratio", 1.0, "ratio", 'r');
+  fs.Bool("verbose", false, "verbose", 'v');
+  fs.String("mode", "fast", "mode", 'm');
+  fs.String("user", "", "user", 'u');
+  fs.StringSet("tags", "", "tags");
+  // the index keeps views of the names, so they must outlive fs
+  static const std::vector<std::string> names = [] {
+    std::vector<std::string> v;
+    for (int i = 0; i < 40; ++i) {
+      v.push_back("option" + std::to_string(i));
+    }
+    return v;
+  }();
+  for (size_t i = 0; i < names.size(); ++i) {
+    fs.Int(names[i], static_cast<int64_t>(i), "option");
+  }
+  fs.Args("[command:string] [targets:string...]");
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  cli::FlagSet opts("parse_cache_bench", "Benchmark for the parse cache");
+  auto linesFlag = opts.Int("lines", 300, "distinct command lines", 'l');
+  auto callsFlag = opts.Int("calls", 1000000, "parses per configuration", 'n');
+  cli::ParseResult pr = opts.Parse(argc, argv);
+  if (pr.kind == cli::ParseErrorKind::HelpRequested) {
+    opts.PrintUsage(std::cout);
+    return 0;
+  }
+  if (!pr) {
+    opts.PrintError(pr, std::cerr);
+    std::cerr << "\n";
+    return 2;
+  }
+
+  std::mt19937 rng(3);
+  size_t nlines = static_cast<size_t>(linesFlag->As<int64_t>());
+  std::vector<std::vector<std::string>> lines(nlines);
+  for (auto &line : lines) {
+    line.push_back("cmd");
+    line.push_back("--port=" + std::to_string(1024 + rng() % 50000));
+    line.push_back("-u");
+    line.push_back("user" + std::to_string(rng() % 100));
+    if (rng() % 2) {
+      line.push_back("--verbose");
+    }
+    line.push_back("--tags=a,b,c" + std::to_string(rng() % 10));
+    line.push_back("--ratio=" + std::to_string(rng() % 100) + ".25");
+    line.push_back("--option" + std::to_string(rng() % 40) + "=" +
+                   std::to_string(rng() % 1000));
+    line.push_back("deploy");
+    line.push_back("host" + std::to_string(rng() % 1000));
+  }
+  std::vector<std::vector<char *>> argvs;
+  for (auto &line : lines) {
+    argvs.emplace_back();
+    for (auto &arg : line) {
+      argvs.back().push_back(&arg[0]);
+    }
+  }
+  std::vector<uint32_t> order(static_cast<size_t>(callsFlag->As<int64_t>()));
+  for (auto &o : order) {
+    o = static_cast<uint32_t>(rng() % nlines);
+  }
+
+  auto run = [&](const char *label, size_t capacity) {
+    cli::FlagSet fs("cmd");
+    DefineFlags(fs);
+    fs.EnableParseCache(capacity);
+    std::vector<double> ns;
+    ns.reserve(order.size());
+    for (uint32_t o : order) {
+      auto &av = argvs[o];
+      auto t0 = std::chrono::steady_clock::now();
+      cli::ParseResult res = fs.Parse(static_cast<int>(av.size()), av.data());
+      auto t1 = std::chrono::steady_clock::now();
+      if (!res) {
+        std::cerr << "parse failed: " << res.message << "\n";
+        std::exit(1);
+      }
+      ns.push_back(std::chrono::duration<double, std::nano>(t1 - t0).count());
+    }
+    double mean = 0;
+    for (double v : ns) {
+      mean += v;
+    }
+    mean /= ns.size();
+    std::sort(ns.begin(), ns.end());
+    auto stats = fs.CacheStats();
+    std::cout << label << "  mean " << mean << " ns  p50 "
+              << ns[ns.size() / 2] << " ns  p99 " << ns[ns.size() * 99 / 100]
+              << " ns  hits " << stats.hits << "  misses " << stats.misses
+              << "\n";
+  };
+
+  std::cout << "lines " << nlines << ", calls " << order.size() << "\n";
+  run("no cache     ", 0);
+  run("full cache   ", nlines);
+  run("half cache   ", nlines / 2);
+  return 0;
+}
@@ -0,0 +1,241 @@
+#include "../cppflag.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runs 1 to N reader threads calling Flag::As<T>, Get<T>(fs, name) and IsSet
+// in tight loops, alone and next to a writer that keeps updating another
+// flag with FlagSet::Set. The writer targets either the flag defined right
+// after the one being read, whose storage is adjacent in memory, or a flag
+// defined far away. A throughput drop with the adjacent writer only is false
+// sharing between the two flags' storage.
+//
+// FlagSet does not support Set while other threads read, so the writer
+// leans on what Set touches today. Both targets are set once before any
+// reader starts. After that, MarkSet finds their bits already set and only
+// reads the shared set-bitset word. Set then writes the target's own value,
+// its set field and its atomic version, and none of these are read by the
+// readers. If Set ever writes state shared between flags, this bench becomes
+// a data race; build it with -fsanitize=thread to check.
+
+namespace {
+
+// Escape keeps the compiler from hoisting reads out of the loops.
+template <typename T> inline void Escape(const T &v) {
+#if defined(__GNUC__)
+  asm volatile("" : : "r,m"(v) : "memory");
+#else
+  static volatile T sink;
+  sink = v;
+#endif
+}
+
+enum class Op { kAs, kGet, kIsSetName, kIsSetHandle };
+enum class Writer { kNone, kAdjacent, kDistant };
+
+const char *OpName(Op op) {
+  switch (op) {
+  case Op::kAs:
+    return "As<int64_t>";
+  case Op::kGet:
+    return "Get<int64_t>";
+  case Op::kIsSetName:
+    return "IsSet(name)";
+  default:
+    return "IsSet(flag)";
+  }
+}
+
+const char *WriterName(Writer w) {
+  switch (w) {
+  case Writer::kNone:
+    return "none";
+  case Writer::kAdjacent:
+    return "adjacent";
+  default:
+    return "distant";
+  }
+}
+
+// Line returns the cache line index of an address.
+uintptr_t Line(const void *p) { return reinterpret_cast<uintptr_t>(p) / 64; }
+
+// SharesLine reports whether the objects at a and b, of the given sizes,
+// touch a common cache line.
+bool SharesLine(const void *a, size_t a_size, const void *b, size_t b_size) {
+  auto end = [](const void *p, size_t size) {
+    return Line(static_cast<const char *>(p) + size - 1);
+  };
+  return Line(a) <= end(b, b_size) && Line(b) <= end(a, a_size);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  cli::FlagSet opts("read_scaling_bench",
+                    "Read scalability benchmark for flag accessors");
+  auto threadsFlag = opts.Int("max_threads", 0, "0 means one per core", 't');
+  auto msFlag = opts.Int("ms", 200, "milliseconds per configuration", 'm');
+  cli::ParseResult pr = opts.Parse(argc, argv);
+  if (pr.kind == cli::ParseErrorKind::HelpRequested) {
+    opts.PrintUsage(std::cout);
+    return 0;
+  }
+  if (!pr) {
+    opts.PrintError(pr, std::cerr);
+    std::cerr << "\n";
+    return 2;
+  }
+
+  // "read" and "adjacent" are defined back to back, and "distant" more than
+  // one set-bitset word and many allocations later
+  cli::FlagSet fs("bench");
+  const cli::Flag *read = fs.Int("read", 1, "read by every thread");
+  const cli::Flag *adjacent = fs.Int("adjacent", 0, "written next door");
+  // the index keeps views of the names, so they must outlive fs
+  std::vector<std::string> fillers;
+  for (int i = 0; i < 256; ++i) {
+    fillers.push_back("filler" + std::to_string(i));
+  }
+  for (const auto &name : fillers) {
+    fs.Int(name, 0, "padding");
+  }
+  const cli::Flag *distant = fs.Int("distant", 0, "written far away");
+
+  auto distance = [](const void *a, const void *b) {
+    return reinterpret_cast<intptr_t>(b) - reinterpret_cast<intptr_t>(a);
+  };
+  std::cout << "read/adjacent: values " << std::showpos
+            << distance(read->value.get(), adjacent->value.get())
+            << " bytes apart ("
+            << (Line(read->value.get()) == Line(adjacent->value.get())
+                    ? "same cache line"
+                    : "different cache lines")
+            << "), Flag structs " << distance(read, adjacent)
+            << " bytes apart" << std::noshowpos << "\n";
+
+  // a slow adjacent writer only proves false sharing when the writer's data
+  // shares a line with the reader's and the writer runs beside the readers
+  // instead of taking turns with them on the same core
+  bool shared_line =
+      SharesLine(read->value.get(), sizeof(cli::ValueAdapter<int64_t>),
+                 adjacent->value.get(), sizeof(cli::ValueAdapter<int64_t>)) ||
+      SharesLine(read, sizeof(cli::Flag), adjacent, sizeof(cli::Flag));
+  unsigned cores = std::thread::hardware_concurrency();
+
+  unsigned max_threads = static_cast<unsigned>(threadsFlag->As<int64_t>());
+  if (max_threads == 0) {
+    max_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  auto duration = std::chrono::milliseconds(msFlag->As<int64_t>());
+  // powers of two up to max_threads, and max_threads itself
+  std::vector<unsigned> thread_counts;
+  for (unsigned t = 1; t < max_threads; t *= 2) {
+    thread_counts.push_back(t);
+  }
+  thread_counts.push_back(max_threads);
+
+  // see the note at the top: the writer's first Set must not race
+  fs.Set(adjacent->name, "2");
+  fs.Set(distant->name, "2");
+
+  // run returns the mean operations per second of one reader thread
+  auto run = [&](Op op, Writer writer, unsigned threads) {
+    std::atomic<bool> stop{false};
+    std::atomic<unsigned> ready{0};
+    std::vector<uint64_t> ops(threads);
+    std::vector<std::thread> readers;
+    for (unsigned t = 0; t < threads; ++t) {
+      readers.emplace_back([&, t] {
+        ready.fetch_add(1);
+        uint64_t n = 0;
+        while (!stop.load(std::memory_order_relaxed)) {
+          for (int k = 0; k < 256; ++k) {
+            switch (op) {
+            case Op::kAs:
+              Escape(read->As<int64_t>());
+              break;
+            case Op::kGet:
+              Escape(cli::Get<int64_t>(fs, "read"));
+              break;
+            case Op::kIsSetName:
+              Escape(fs.IsSet("read"));
+              break;
+            case Op::kIsSetHandle:
+              Escape(fs.IsSet(read));
+              break;
+            }
+          }
+          n += 256;
+        }
+        ops[t] = n;
+      });
+    }
+    std::thread writer_thread;
+    if (writer != Writer::kNone) {
+      std::string target =
+          writer == Writer::kAdjacent ? adjacent->name : distant->name;
+      writer_thread = std::thread([&, target] {
+        for (uint64_t i = 0; !stop.load(std::memory_order_relaxed); ++i) {
+          fs.Set(target, i & 1 ? "1" : "2");
+        }
+      });
+    }
+    while (ready.load() < threads) {
+      std::this_thread::yield();
+    }
+    std::this_thread::sleep_for(duration);
+    stop.store(true);
+    for (auto &r : readers) {
+      r.join();
+    }
+    if (writer_thread.joinable()) {
+      writer_thread.join();
+    }
+    uint64_t total = 0;
+    for (uint64_t n : ops) {
+      total += n;
+    }
+    return static_cast<double>(total) / threads /
+           std::chrono::duration<double>(duration).count();
+  };
+
+  std::cout << std::left << std::setw(14) << "op" << std::setw(10) << "writer"
+            << std::setw(9) << "threads"
+            << "Mops/s per thread\n";
+  bool suspect = false;
+  for (Op op : {Op::kAs, Op::kGet, Op::kIsSetName, Op::kIsSetHandle}) {
+    for (unsigned t : thread_counts) {
+      double per_writer[3];
+      for (Writer w : {Writer::kNone, Writer::kAdjacent, Writer::kDistant}) {
+        double rate = run(op, w, t);
+        per_writer[static_cast<int>(w)] = rate;
+        std::cout << std::setw(14) << OpName(op) << std::setw(10)
+                  << WriterName(w) << std::setw(9) << t << std::fixed
+                  << std::setprecision(1) << rate / 1e6 << "\n";
+      }
+      // a writer on the adjacent flag should cost no more than a distant one
+      if (per_writer[1] < 0.8 * per_writer[2]) {
+        bool conclusive = shared_line && cores >= t + 1;
+        std::cout << "  " << (conclusive ? "possible false sharing: " : "")
+                  << "adjacent writer is " << std::setprecision(0)
+                  << 100 * (1 - per_writer[1] / per_writer[2])
+                  << "% slower than distant";
+        if (!shared_line) {
+          std::cout << " (no shared cache line, timing noise)";
+        } else if (!conclusive) {
+          std::cout << " (" << t + 1 << " threads on " << cores
+                    << " cores, timing noise)";
+        }
+        std::cout << "\n";
+        suspect = suspect || conclusive;
+      }
+    }
+  }
+  return suspect ? 3 : 0;
+}
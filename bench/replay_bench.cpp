@@ -0,0 +1,114 @@
+#include "../cppflag.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+
+// DefineFlags registers the flags of the binary whose parse log is replayed.
+// Replace it with the definitions of your own binary.
+static void DefineFlags(cli::FlagSet &fs) {
+  fs.Int("port", 8080, "port to listen on", 'p');
+  fs.Bool("debug", false, "enable debug logging", 'd');
+  fs.Float("ratio", 1.0, "ratio for calculation", 'r');
+  fs.String("mode", "fast", "running mode", 'm');
+}
+
+int main(int argc, char **argv) {
+  cli::FlagSet opts("replay_bench", "Replays a parse log at full speed");
+  auto logFlag = opts.String("log", "", "parse log written by ParseRecorder");
+  auto iterFlag = opts.Int("iterations", 10, "passes over the log", 'n');
+  cli::ParseResult pr = opts.Parse(argc, argv);
+  if (pr.kind == cli::ParseErrorKind::HelpRequested) {
+    opts.PrintUsage(std::cout);
+    return 0;
+  }
+  if (!pr || logFlag->As<std::string>().empty()) {
+    if (!pr) {
+      opts.PrintError(pr, std::cerr);
+      std::cerr << "\n";
+    }
+    opts.PrintUsage(std::cerr);
+    return 2;
+  }
+
+  std::FILE *in = std::fopen(logFlag->As<std::string>().c_str(), "rb");
+  if (!in) {
+    std::perror("open log");
+    return 1;
+  }
+  std::vector<cli::ParseRecord> records;
+  std::string err;
+  bool ok = cli::ReadParseLog(in, records, err);
+  std::fclose(in);
+  if (!ok) {
+    std::cerr << "error: " << err << "\n";
+    return 1;
+  }
+  if (records.empty()) {
+    std::cerr << "error: empty log\n";
+    return 1;
+  }
+
+  // Parse takes char**, so keep a pointer table per record.
+  std::vector<std::vector<char *>> argvs(records.size());
+  for (size_t i = 0; i < records.size(); ++i) {
+    for (auto &a : records[i].args) {
+      argvs[i].push_back(&a[0]);
+    }
+    argvs[i].push_back(nullptr);
+  }
+
+  cli::FlagSet fs("replay");
+  DefineFlags(fs);
+
+  int64_t iterations = std::max<int64_t>(1, iterFlag->As<int64_t>());
+  std::vector<double> latencies;
+  latencies.reserve(records.size() * iterations);
+  size_t mismatches = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int64_t it = 0; it < iterations; ++it) {
+    for (size_t i = 0; i < records.size(); ++i) {
+      const auto &rec = records[i];
+      auto t0 = std::chrono::steady_clock::now();
+      cli::ParseResult res =
+          fs.Parse(static_cast<int>(rec.args.size()), argvs[i].data());
+      auto t1 = std::chrono::steady_clock::now();
+      latencies.push_back(std::chrono::duration<double, std::nano>(t1 - t0)
+                              .count());
+      if (it != 0 || !rec.has_outcome) {
+        continue;
+      }
+      if (res.kind != rec.kind || (!res.ok() && res.flag != rec.flag)) {
+        if (++mismatches <= 10) {
+          std::cerr << "mismatch in record " << i << ": recorded kind "
+                    << static_cast<int>(rec.kind) << " flag '" << rec.flag
+                    << "', got kind " << static_cast<int>(res.kind)
+                    << " flag '" << res.flag << "'\n";
+        }
+      } else if (res.ok() && fs.Snapshot(err) != rec.values) {
+        // the snapshot holds the type name and encoded bytes of every value
+        // set, so this catches a flag that now parses to something else
+        if (++mismatches <= 10) {
+          std::cerr << "mismatch in record " << i << ": values differ\n";
+        }
+      }
+    }
+  }
+  double total_s = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+  std::sort(latencies.begin(), latencies.end());
+  auto pct = [&](double p) {
+    return latencies[static_cast<size_t>(p * (latencies.size() - 1))];
+  };
+  std::cout << "records:     " << records.size() << "\n";
+  std::cout << "parses:      " << latencies.size() << "\n";
+  std::cout << "throughput:  " << latencies.size() / total_s << " parses/s\n";
+  std::cout << "latency ns:  p50 " << pct(0.50) << "  p90 " << pct(0.90)
+            << "  p99 " << pct(0.99) << "  p99.9 " << pct(0.999) << "  max "
+            << latencies.back() << "\n";
+  std::cout << "mismatches:  " << mismatches << "\n";
+  return mismatches == 0 ? 0 : 3;
+}
@@ -0,0 +1,114 @@
+#include "../cppflag.hpp"
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+
+// Measures the UTF-8 check of strict string flags on long values, both
+// ASCII and mixed-script text. It compares cli::detail::FindInvalidUtf8
+// with a byte-at-a-time validator of the kind run after Parse, and reports
+// the cost of a strict String flag Parse against a plain one. Build with
+// -mavx2 to use the 32-byte path.
+
+namespace {
+
+// Bytewise is the byte-at-a-time reference: one branchy step per byte.
+size_t Bytewise(std::string_view text) {
+  const auto *s = reinterpret_cast<const unsigned char *>(text.data());
+  size_t n = text.size();
+  for (size_t i = 0; i < n;) {
+    if (s[i] < 0x80) {
+      ++i;
+      continue;
+    }
+    size_t end = cli::detail::Utf8SequenceEnd(s, n, i);
+    if (end == i) {
+      return i;
+    }
+    i = end;
+  }
+  return std::string_view::npos;
+}
+
+std::string Text(size_t size, bool mixed, std::mt19937 &rng) {
+  static const char *const kWords[] = {"tenant", "région", "Straße",
+                                       "東京",   "данные", "😀"};
+  std::string out;
+  while (out.size() < size) {
+    out += mixed ? kWords[rng() % 6] : kWords[0];
+    out += ' ';
+  }
+  // trim back to a character boundary
+  out.resize(size);
+  while (!out.empty() &&
+         cli::detail::FindInvalidUtf8(out) != std::string_view::npos) {
+    out.pop_back();
+  }
+  return out;
+}
+
+template <typename Fn> double NsPerCall(int64_t calls, Fn fn) {
+  auto t0 = std::chrono::steady_clock::now();
+  for (int64_t i = 0; i < calls; ++i) {
+    fn();
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(t1 - t0).count() / calls;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  cli::FlagSet opts("utf8_bench", "Benchmark for strict UTF-8 string flags");
+  auto sizeFlag = opts.Int("size", 4096, "value length in bytes", 's');
+  auto callsFlag = opts.Int("calls", 200000, "calls per measurement", 'n');
+  cli::ParseResult pr = opts.Parse(argc, argv);
+  if (pr.kind == cli::ParseErrorKind::HelpRequested) {
+    opts.PrintUsage(std::cout);
+    return 0;
+  }
+  if (!pr) {
+    opts.PrintError(pr, std::cerr);
+    std::cerr << "\n";
+    return 2;
+  }
+
+  std::mt19937 rng(9);
+  size_t size = static_cast<size_t>(sizeFlag->As<int64_t>());
+  int64_t calls = callsFlag->As<int64_t>();
+  size_t sink = 0;
+#if defined(__AVX2__)
+  std::cout << "path avx2";
+#elif defined(__SSE2__)
+  std::cout << "path sse2 ascii";
+#else
+  std::cout << "path scalar";
+#endif
+  std::cout << ", value " << size << " bytes\n";
+
+  for (bool mixed : {false, true}) {
+    std::string text = Text(size, mixed, rng);
+    double bytewise = NsPerCall(
+        calls, [&] { sink += Bytewise(text) == std::string_view::npos; });
+    double vector = NsPerCall(calls, [&] {
+      sink += cli::detail::FindInvalidUtf8(text) == std::string_view::npos;
+    });
+
+    std::string arg = "--value=" + text;
+    char *av[] = {const_cast<char *>("svc"), &arg[0]};
+    cli::FlagSet plain("svc");
+    plain.String("value", "", "value");
+    cli::FlagSet strict("svc");
+    strict.StrictUtf8(strict.String("value", "", "value"));
+    double plain_ns =
+        NsPerCall(calls, [&] { sink += plain.Parse(2, av).ok(); });
+    double strict_ns =
+        NsPerCall(calls, [&] { sink += strict.Parse(2, av).ok(); });
+
+    std::cout << (mixed ? "mixed" : "ascii") << "  bytewise "
+              << size / bytewise << " GB/s  vector " << size / vector
+              << " GB/s  (" << bytewise / vector << "x)  Parse plain "
+              << plain_ns << " ns  strict " << strict_ns << " ns\n";
+  }
+  return sink == 0 ? 1 : 0;
+}
@@ -1,12 +1,64 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
 #include <cassert>
-#include <iostream>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+// Defining CPPFLAG_NO_IOSTREAM drops <iostream> and the std::ostream
+// overloads; output then goes through cli::Sink only.
+#if !defined(CPPFLAG_NO_IOSTREAM)
+#include <iostream>
+#endif
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Defining CPPFLAG_USDT compiles SystemTap/USDT probes into the parse and
+// update paths. They are single nops until a tracer attaches.
+#if defined(CPPFLAG_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CPPFLAG_PROBE2(name, a, b) DTRACE_PROBE2(cppflag, name, a, b)
+#define CPPFLAG_PROBE3(name, a, b, c) DTRACE_PROBE3(cppflag, name, a, b, c)
+#define CPPFLAG_PROBE4(name, a, b, c, d)                                      \
+  DTRACE_PROBE4(cppflag, name, a, b, c, d)
+#endif
+#endif
+#ifndef CPPFLAG_PROBE2
+#define CPPFLAG_PROBE2(name, a, b) ((void)0)
+#define CPPFLAG_PROBE3(name, a, b, c) ((void)0)
+#define CPPFLAG_PROBE4(name, a, b, c, d) ((void)0)
+#endif
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
 namespace cli {
 
 enum class ParseErrorKind {
@@ -15,12 +67,21 @@ enum class ParseErrorKind {
   UnknownFlag,
   MissingValue,
   InvalidValue,
+  InvalidSnapshot,
+  MissingArgument,
+  UnexpectedArgument,
+  ValidationFailed,
 };
 
 struct ParseResult {
   ParseErrorKind kind = ParseErrorKind::None;
   std::string flag;
   std::string message;
+  /* offset is the position of the offending byte for errors that have one,
+     such as invalid UTF-8 or JSON, and npos otherwise. It counts from the
+     start of the flag's value, not of the argv token, so for
+     "--name=caf\xe9" it is 3. */
+  size_t offset = std::string::npos;
   bool ok() const { return kind == ParseErrorKind::None; }
   explicit operator bool() const { return ok(); }
 };
@@ -32,373 +93,4255 @@ public:
      It returns true on success and false on failure, setting err to an error
      message. */
   virtual bool Set(std::string_view text, std::string &err) = 0;
+  /* SetWithOffset is Set that also reports where text was rejected: offset
+     is set to the position of the offending byte for errors that have one,
+     such as invalid UTF-8 or JSON, and to npos otherwise. By default it
+     calls Set and reports npos. */
+  virtual bool SetWithOffset(std::string_view text, std::string &err,
+                             size_t &offset) {
+    offset = std::string::npos;
+    return Set(text, err);
+  }
   /* TypeName returns the type name of the value. */
   virtual std::string TypeName() const = 0;
   /* ToString returns the string representation of the value. */
   virtual std::string ToString() const = 0;
   /* clone returns a copy of the value object. */
   virtual IValue *clone() const = 0;
+  /* Encode appends the snapshot encoding of the value to out. By default it
+     is the ToString representation. */
+  virtual void Encode(std::string &out) const { out += ToString(); }
+  /* Decode restores a value written by Encode. */
+  virtual bool Decode(std::string_view data, std::string &err) {
+    return Set(data, err);
+  }
+  /* DecodeWithOffset is Decode that reports an offset as SetWithOffset
+     does. */
+  virtual bool DecodeWithOffset(std::string_view data, std::string &err,
+                                size_t &offset) {
+    offset = std::string::npos;
+    return Decode(data, err);
+  }
 };
 
-template <typename T> class ValueAdapter : public IValue {
+namespace detail {
+
+/* DefinitionError reports a programming error in a flag definition, such as
+   an invalid default value, and aborts. Like a malformed Args schema, it
+   must not slip through release builds, so it is checked in every build
+   type. */
+[[noreturn]] inline void DefinitionError(std::string_view flag,
+                                         const std::string &what) {
+  std::fprintf(stderr, "cppflag: flag --%.*s: %s\n",
+               static_cast<int>(flag.size()), flag.data(), what.c_str());
+  std::abort();
+}
+
+/* NextGeneration returns a value no FlagSet has used as its generation. */
+inline uint64_t NextGeneration() {
+  static std::atomic<uint64_t> next{1};
+  return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+/* HashBytes is a fast non-cryptographic hash that consumes 8 bytes per
+   step. */
+inline uint64_t HashBytes(std::string_view s, uint64_t seed = 0) {
+  constexpr uint64_t kMul = 0x9e3779b97f4a7c15ull;
+  uint64_t h = seed ^ (s.size() * kMul);
+  const char *p = s.data();
+  size_t n = s.size();
+  for (; n >= 8; p += 8, n -= 8) {
+    uint64_t w;
+    std::memcpy(&w, p, 8);
+    h = (h ^ w) * kMul;
+    h ^= h >> 29;
+  }
+  if (n > 0) {
+    uint64_t w = 0;
+    std::memcpy(&w, p, n);
+    h = (h ^ w) * kMul;
+  }
+  h ^= h >> 32;
+  h *= 0xd6e8feb86659fd93ull;
+  h ^= h >> 32;
+  return h;
+}
+
+/* SwapToLittleEndian converts n bytes between host and little-endian byte
+   order in place. It is its own inverse. */
+inline void SwapToLittleEndian(char *p, size_t n) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  std::reverse(p, p + n);
+#else
+  (void)p;
+  (void)n;
+#endif
+}
+
+/* TokenDesc describes one argv entry: its length, the position of its first
+   '=' (len if there is none) and its number of leading dashes, capped at 2. */
+struct TokenDesc {
+  uint32_t len;
+  uint32_t eq;
+  uint8_t dashes;
+};
+
+// Defining CPPFLAG_SIMD_CLASSIFY makes ClassifyToken scan with AVX2 or SSE2.
+// The vector scans read whole aligned blocks, which may extend past the
+// terminating NUL but never cross into the next page. The C library's
+// strlen and memchr, which the default scalar path uses, are vectorized
+// already on common targets and measured as fast or faster, so the
+// over-reading path is opt-in.
+#if defined(CPPFLAG_SIMD_CLASSIFY) && (defined(__AVX2__) || defined(__SSE2__))
+#define CPPFLAG_CLASSIFY_VECTOR 1
+#endif
+#if defined(CPPFLAG_CLASSIFY_VECTOR) && defined(__GNUC__)
+#define CPPFLAG_NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#else
+#define CPPFLAG_NO_SANITIZE_ADDRESS
+#endif
+
+inline unsigned CountTrailingZeros(uint64_t v) {
+#if defined(__GNUC__)
+  return static_cast<unsigned>(__builtin_ctzll(v));
+#else
+  unsigned n = 0;
+  while ((v & 1) == 0) {
+    v >>= 1;
+    ++n;
+  }
+  return n;
+#endif
+}
+
+inline TokenDesc ClassifyTokenScalar(const char *s) {
+  size_t len = std::strlen(s);
+  const void *eq = std::memchr(s, '=', len);
+  return TokenDesc{
+      static_cast<uint32_t>(len),
+      static_cast<uint32_t>(eq ? static_cast<const char *>(eq) - s : len),
+      static_cast<uint8_t>(s[0] == '-' ? (s[1] == '-' ? 2 : 1) : 0)};
+}
+
+/* ClassifyToken finds the length and the first '=' of s. With
+   CPPFLAG_SIMD_CLASSIFY it does so in one AVX2 or SSE2 pass when the target
+   supports them; otherwise it is ClassifyTokenScalar. */
+CPPFLAG_NO_SANITIZE_ADDRESS inline TokenDesc ClassifyToken(const char *s) {
+#if defined(CPPFLAG_CLASSIFY_VECTOR)
+#if defined(__AVX2__)
+  constexpr size_t kWidth = 32;
+#else
+  constexpr size_t kWidth = 16;
+#endif
+  uintptr_t addr = reinterpret_cast<uintptr_t>(s);
+  const char *p = reinterpret_cast<const char *>(addr & ~(kWidth - 1));
+  unsigned skip = static_cast<unsigned>(addr & (kWidth - 1));
+  uint8_t dashes = s[0] == '-' ? (s[1] == '-' ? 2 : 1) : 0;
+  // first find whichever of '=' and NUL comes first with a single mask
+  uint64_t hits;
+  uint64_t nul;
+  for (;; p += kWidth, skip = 0) {
+#if defined(__AVX2__)
+    __m256i v = _mm256_load_si256(reinterpret_cast<const __m256i *>(p));
+    __m256i z = _mm256_cmpeq_epi8(v, _mm256_setzero_si256());
+    __m256i e = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('='));
+    hits = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(z, e)));
+    nul = static_cast<uint32_t>(_mm256_movemask_epi8(z));
+#else
+    __m128i v = _mm_load_si128(reinterpret_cast<const __m128i *>(p));
+    __m128i z = _mm_cmpeq_epi8(v, _mm_setzero_si128());
+    __m128i e = _mm_cmpeq_epi8(v, _mm_set1_epi8('='));
+    hits = static_cast<uint32_t>(_mm_movemask_epi8(_mm_or_si128(z, e)));
+    nul = static_cast<uint32_t>(_mm_movemask_epi8(z));
+#endif
+    hits = (hits >> skip) << skip;
+    if (hits != 0) {
+      break;
+    }
+  }
+  unsigned first = CountTrailingZeros(hits);
+  size_t pos = static_cast<size_t>(p + first - s);
+  if (nul & (uint64_t(1) << first)) {
+    return TokenDesc{static_cast<uint32_t>(pos), static_cast<uint32_t>(pos),
+                     dashes};
+  }
+  // then only the NUL is left to find; once p is 64-byte aligned, whole
+  // cache lines are checked at a time
+  nul = (nul >> first) << first;
+  while (nul == 0 && (reinterpret_cast<uintptr_t>(p) & 63) != 64 - kWidth) {
+    p += kWidth;
+#if defined(__AVX2__)
+    __m256i v = _mm256_load_si256(reinterpret_cast<const __m256i *>(p));
+    nul = static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+#else
+    __m128i v = _mm_load_si128(reinterpret_cast<const __m128i *>(p));
+    nul = static_cast<uint32_t>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())));
+#endif
+  }
+  if (nul == 0) {
+    p += kWidth;
+    for (;; p += 64) {
+#if defined(__AVX2__)
+      __m256i a = _mm256_load_si256(reinterpret_cast<const __m256i *>(p));
+      __m256i b = _mm256_load_si256(reinterpret_cast<const __m256i *>(p + 32));
+      __m256i z = _mm256_cmpeq_epi8(_mm256_min_epu8(a, b),
+                                    _mm256_setzero_si256());
+      if (_mm256_movemask_epi8(z) == 0) {
+        continue;
+      }
+      uint64_t lo = static_cast<uint32_t>(
+          _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, _mm256_setzero_si256())));
+      uint64_t hi = static_cast<uint32_t>(
+          _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, _mm256_setzero_si256())));
+      nul = lo | (hi << 32);
+#else
+      const __m128i *q = reinterpret_cast<const __m128i *>(p);
+      __m128i a = _mm_load_si128(q), b = _mm_load_si128(q + 1);
+      __m128i c = _mm_load_si128(q + 2), d = _mm_load_si128(q + 3);
+      __m128i m = _mm_min_epu8(_mm_min_epu8(a, b), _mm_min_epu8(c, d));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(m, _mm_setzero_si128())) == 0) {
+        continue;
+      }
+      __m128i zero = _mm_setzero_si128();
+      nul = static_cast<uint64_t>(static_cast<uint16_t>(
+                _mm_movemask_epi8(_mm_cmpeq_epi8(a, zero)))) |
+            static_cast<uint64_t>(static_cast<uint16_t>(
+                _mm_movemask_epi8(_mm_cmpeq_epi8(b, zero))))
+                << 16 |
+            static_cast<uint64_t>(static_cast<uint16_t>(
+                _mm_movemask_epi8(_mm_cmpeq_epi8(c, zero))))
+                << 32 |
+            static_cast<uint64_t>(static_cast<uint16_t>(
+                _mm_movemask_epi8(_mm_cmpeq_epi8(d, zero))))
+                << 48;
+#endif
+      break;
+    }
+  }
+  size_t len = static_cast<size_t>(p + CountTrailingZeros(nul) - s);
+  return TokenDesc{static_cast<uint32_t>(len), static_cast<uint32_t>(pos),
+                   dashes};
+#else
+  return ClassifyTokenScalar(s);
+#endif
+}
+
+/* TokenCursor classifies argv in blocks ahead of the parse loop and hands out
+   the descriptors by argv index. */
+class TokenCursor {
 public:
-  using Tp = std::remove_cv_t<std::decay_t<T>>;
-  explicit ValueAdapter(T val) : value_(val) {
-    if constexpr (std::is_same<Tp, int64_t>::value) {
-      type_name_ = "int";
-    } else if constexpr (std::is_same<Tp, float>::value ||
-                         std::is_same<Tp, double>::value) {
-      type_name_ = "float";
-    } else if constexpr (std::is_same<Tp, bool>::value) {
-      type_name_ = "bool";
-    } else if constexpr (std::is_same<Tp, std::string>::value) {
-      type_name_ = "string";
+  explicit TokenCursor(char **argv, int end) : argv_(argv), end_(end) {}
+  const TokenDesc &At(int i) {
+    if (i < begin_ || i >= begin_ + count_) {
+      begin_ = i;
+      count_ = std::min(kBlock, end_ - i);
+      for (int k = 0; k < count_; ++k) {
+        descs_[k] = ClassifyToken(argv_[i + k]);
+      }
     }
+    return descs_[i - begin_];
+  }
+
+private:
+  static constexpr int kBlock = 64;
+  char **argv_;
+  int end_;
+  int begin_ = 0;
+  int count_ = 0;
+  TokenDesc descs_[kBlock];
+};
+
+/* Utf8SequenceEnd checks the sequence that starts with the non-ASCII byte
+   s[i] and returns the index just past it, or i if it is ill-formed. */
+inline size_t Utf8SequenceEnd(const unsigned char *s, size_t n, size_t i) {
+  unsigned char c = s[i];
+  size_t len;
+  // bounds of the second byte, narrowed to rule out overlong forms,
+  // surrogates and code points above U+10FFFF
+  unsigned char lo = 0x80, hi = 0xbf;
+  if (c >= 0xc2 && c <= 0xdf) {
+    len = 2;
+  } else if (c >= 0xe0 && c <= 0xef) {
+    len = 3;
+    lo = c == 0xe0 ? 0xa0 : lo;
+    hi = c == 0xed ? 0x9f : hi;
+  } else if (c >= 0xf0 && c <= 0xf4) {
+    len = 4;
+    lo = c == 0xf0 ? 0x90 : lo;
+    hi = c == 0xf4 ? 0x8f : hi;
+  } else {
+    return i;
+  }
+  if (n - i < len || s[i + 1] < lo || s[i + 1] > hi) {
+    return i;
+  }
+  for (size_t k = 2; k < len; ++k) {
+    if ((s[i + k] & 0xc0) != 0x80) {
+      return i;
+    }
+  }
+  return i + len;
+}
+
+#if defined(__AVX2__)
+/* Utf8ValidPrefix returns a character boundary b such that s[0, b) is valid
+   UTF-8. It checks 32 bytes per step with the lookup tables of Keiser and
+   Lemire, and stops at the first block with an error; the caller finds the
+   exact offset from b. */
+inline size_t Utf8ValidPrefix(const unsigned char *s, size_t n) {
+  // each bit names an error that a pair of adjacent bytes can reveal; a
+  // pair is bad when all three tables agree on a bit
+  constexpr uint8_t kTooShort = 1 << 0;  // lead not followed by continuation
+  constexpr uint8_t kTooLong = 1 << 1;   // continuation after ASCII
+  constexpr uint8_t kOverlong3 = 1 << 2; // E0 80-9F
+  constexpr uint8_t kTooLarge = 1 << 3;  // F4 90-BF, F5-FF
+  constexpr uint8_t kSurrogate = 1 << 4; // ED A0-BF
+  constexpr uint8_t kOverlong2 = 1 << 5; // C0-C1
+  constexpr uint8_t kTooLarge1000 = 1 << 6;
+  constexpr uint8_t kOverlong4 = 1 << 6; // F0 80-8F
+  constexpr uint8_t kTwoConts = 1 << 7;  // continuation after continuation
+  constexpr uint8_t kCarry = kTooShort | kTooLong | kTwoConts;
+  alignas(16) static constexpr uint8_t kByte1High[16] = {
+      kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong,
+      kTooLong, kTooLong, kTwoConts, kTwoConts, kTwoConts, kTwoConts,
+      kTooShort | kOverlong2, kTooShort,
+      kTooShort | kOverlong3 | kSurrogate,
+      kTooShort | kTooLarge | kTooLarge1000 | kOverlong4};
+  alignas(16) static constexpr uint8_t kByte1Low[16] = {
+      kCarry | kOverlong3 | kOverlong2 | kOverlong4,
+      kCarry | kOverlong2,
+      kCarry,
+      kCarry,
+      kCarry | kTooLarge,
+      kCarry | kTooLarge | kTooLarge1000,
+      kCarry | kTooLarge | kTooLarge1000,
+      kCarry | kTooLarge | kTooLarge1000,
+      kCarry | kTooLarge | kTooLarge1000,
+      kCarry | kTooLarge | kTooLarge1000,
+      kCarry | kTooLarge | kTooLarge1000,
+      kCarry | kTooLarge | kTooLarge1000,
+      kCarry | kTooLarge | kTooLarge1000,
+      kCarry | kTooLarge | kTooLarge1000 | kSurrogate,
+      kCarry | kTooLarge | kTooLarge1000,
+      kCarry | kTooLarge | kTooLarge1000};
+  alignas(16) static constexpr uint8_t kByte2High[16] = {
+      kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort,
+      kTooShort, kTooShort,
+      kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge1000 |
+          kOverlong4,
+      kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge,
+      kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+      kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+      kTooShort, kTooShort, kTooShort, kTooShort};
+  auto table = [](const uint8_t *t) {
+    return _mm256_broadcastsi128_si256(
+        _mm_load_si128(reinterpret_cast<const __m128i *>(t)));
   };
-  bool Set(std::string_view text, std::string &err) override {
-    if constexpr (std::is_same<Tp, int64_t>::value) {
-      try {
-        value_ = std::stoll(std::string(text));
-      } catch (const std::invalid_argument &ia) {
-        err = "not an integer";
+  const __m256i byte1_high = table(kByte1High);
+  const __m256i byte1_low = table(kByte1Low);
+  const __m256i byte2_high = table(kByte2High);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  // a lead byte in the last three positions needs bytes from the next block
+  const __m256i max_complete = _mm256_setr_epi8(
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, static_cast<char>(0xef),
+      static_cast<char>(0xdf), static_cast<char>(0xbf));
+  __m256i prev = _mm256_setzero_si256();
+  __m256i incomplete = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i));
+    if (_mm256_movemask_epi8(in) == 0) {
+      if (!_mm256_testz_si256(incomplete, incomplete)) {
+        break;
+      }
+      prev = in;
+      continue;
+    }
+    __m256i carried = _mm256_permute2x128_si256(prev, in, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(in, carried, 15);
+    __m256i prev2 = _mm256_alignr_epi8(in, carried, 14);
+    __m256i prev3 = _mm256_alignr_epi8(in, carried, 13);
+    __m256i special = _mm256_and_si256(
+        _mm256_and_si256(
+            _mm256_shuffle_epi8(
+                byte1_high,
+                _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+            _mm256_shuffle_epi8(byte1_low, _mm256_and_si256(prev1, nibble))),
+        _mm256_shuffle_epi8(
+            byte2_high, _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble)));
+    // the third and fourth bytes of a sequence must be continuations, and
+    // those are exactly the continuation pairs kTwoConts is not an error for
+    __m256i must_continue = _mm256_or_si256(
+        _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xe0 - 0x80)),
+        _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xf0 - 0x80)));
+    __m256i err = _mm256_xor_si256(
+        _mm256_and_si256(must_continue,
+                         _mm256_set1_epi8(static_cast<char>(0x80))),
+        special);
+    if (!_mm256_testz_si256(err, err)) {
+      break;
+    }
+    incomplete = _mm256_subs_epu8(in, max_complete);
+    prev = in;
+  }
+  // step back over a sequence that straddles the first unchecked byte
+  for (size_t k = 1; k <= 3 && k <= i; ++k) {
+    unsigned char c = s[i - k];
+    if (c < 0x80) {
+      break;
+    }
+    if (c >= 0xc0) {
+      size_t len = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : 2;
+      i -= len > k ? k : 0;
+      break;
+    }
+  }
+  return i;
+}
+#endif
+
+/* FindInvalidUtf8 returns the offset of the first byte of text that does
+   not start a well-formed UTF-8 sequence, or npos if text is valid UTF-8.
+   A truncated sequence is reported at its first byte. With AVX2 the whole
+   text is checked 32 bytes at a time; with SSE2 each run of ASCII is
+   crossed 16 bytes at a time. */
+inline size_t FindInvalidUtf8(std::string_view text) {
+  const auto *s = reinterpret_cast<const unsigned char *>(text.data());
+  size_t n = text.size();
+  size_t i = 0;
+#if defined(__AVX2__)
+  i = Utf8ValidPrefix(s, n);
+#endif
+  while (i < n) {
+    if (s[i] < 0x80) {
+#if defined(__SSE2__)
+      if (i + 16 <= n) {
+        // jump to the next non-ASCII byte, or past all 16
+        unsigned high = static_cast<unsigned>(_mm_movemask_epi8(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i))));
+        i += high == 0 ? 16 : CountTrailingZeros(high);
+        continue;
+      }
+#endif
+      ++i;
+      continue;
+    }
+    size_t end = Utf8SequenceEnd(s, n, i);
+    if (end == i) {
+      return i;
+    }
+    i = end;
+  }
+  return std::string_view::npos;
+}
+
+} // namespace detail
+
+/* StringSetValue is an immutable set of strings parsed from a comma-separated
+   list. The entries live in one arena and are indexed by an open-addressing
+   table kept at most half full, so contains usually touches one slot and one
+   arena line. */
+class StringSetValue {
+public:
+  static constexpr const char *kTypeName = "stringset";
+
+  /* contains reports whether s is in the set. */
+  bool contains(std::string_view s) const {
+    if (size_ == 0) {
+      return false;
+    }
+    uint64_t h = detail::HashBytes(s);
+    uint32_t tag = static_cast<uint32_t>(h >> 32);
+    for (size_t i = h & mask_;; i = (i + 1) & mask_) {
+      const Slot &slot = slots_[i];
+      if (slot.offset == kEmpty) {
         return false;
-      } catch (const std::out_of_range &oor) {
-        err = "out of range for int64_t";
+      }
+      if (slot.tag == tag && slot.len == s.size() &&
+          std::memcmp(arena_.data() + slot.offset, s.data(), s.size()) == 0) {
+        return true;
+      }
+    }
+  }
+  /* size returns the number of distinct entries. */
+  size_t size() const { return size_; }
+
+  bool Parse(std::string_view text, std::string &err) {
+    if (text.size() >= kEmpty) {
+      err = "list too long";
+      return false;
+    }
+    size_t items = text.empty() ? 0 : 1;
+    for (char c : text) {
+      items += c == ',';
+    }
+    size_t cap = 2;
+    while (cap < items * 2) {
+      cap <<= 1;
+    }
+    arena_.clear();
+    arena_.reserve(text.size());
+    slots_.assign(cap, Slot{0, 0, kEmpty});
+    mask_ = cap - 1;
+    size_ = 0;
+    size_t pos = 0;
+    while (pos <= text.size() && !text.empty()) {
+      size_t comma = text.find(',', pos);
+      if (comma == std::string_view::npos) {
+        comma = text.size();
+      }
+      std::string_view item = text.substr(pos, comma - pos);
+      pos = comma + 1;
+      if (item.empty() || contains(item)) {
+        continue;
+      }
+      if (!arena_.empty()) {
+        arena_ += ',';
+      }
+      uint64_t h = detail::HashBytes(item);
+      size_t i = h & mask_;
+      while (slots_[i].offset != kEmpty) {
+        i = (i + 1) & mask_;
+      }
+      slots_[i] = Slot{static_cast<uint32_t>(h >> 32),
+                       static_cast<uint32_t>(item.size()),
+                       static_cast<uint32_t>(arena_.size())};
+      arena_ += item;
+      ++size_;
+    }
+    return true;
+  }
+  std::string ToString() const { return arena_; }
+
+private:
+  static constexpr uint32_t kEmpty = UINT32_MAX;
+  struct Slot {
+    uint32_t tag;
+    uint32_t len;
+    uint32_t offset;
+  };
+  std::string arena_;
+  std::vector<Slot> slots_;
+  size_t mask_ = 0;
+  size_t size_ = 0;
+};
+
+/* FeatureSet is a packed set of feature toggles. Each registered feature name
+   maps to the bit of its registration position, so hot code tests a feature
+   with a single AND against a constant such as FeatureSet::Bit(3). */
+class FeatureSet {
+public:
+  static constexpr const char *kTypeName = "features";
+  static constexpr size_t kMaxFeatures = 64;
+
+  FeatureSet() = default;
+  explicit FeatureSet(std::initializer_list<std::string_view> names)
+      : names_(std::make_shared<std::vector<std::string>>(names.begin(),
+                                                          names.end())) {
+    // Bit(i) past 63 would shift beyond the word
+    if (names.size() > kMaxFeatures) {
+      std::fprintf(stderr, "cppflag: %zu features, at most %zu are allowed\n",
+                   names.size(), kMaxFeatures);
+      std::abort();
+    }
+  }
+
+  /* Bit returns the mask of the feature registered at position i. */
+  static constexpr uint64_t Bit(unsigned i) { return uint64_t(1) << i; }
+  /* bits returns the packed set of enabled features. */
+  uint64_t bits() const { return bits_; }
+  /* has reports whether every feature in mask is enabled. */
+  bool has(uint64_t mask) const { return (bits_ & mask) == mask; }
+  /* BitOf returns the mask of the named feature, or 0 if it is unknown. */
+  uint64_t BitOf(std::string_view name) const {
+    for (size_t i = 0; names_ && i < names_->size(); ++i) {
+      if ((*names_)[i] == name) {
+        return Bit(static_cast<unsigned>(i));
+      }
+    }
+    return 0;
+  }
+
+  bool Parse(std::string_view text, std::string &err) {
+    uint64_t bits = 0;
+    size_t pos = 0;
+    while (pos < text.size()) {
+      size_t comma = text.find(',', pos);
+      if (comma == std::string_view::npos) {
+        comma = text.size();
+      }
+      std::string_view item = text.substr(pos, comma - pos);
+      pos = comma + 1;
+      if (item.empty()) {
+        continue;
+      }
+      uint64_t bit = BitOf(item);
+      if (bit == 0) {
+        err = "unknown feature '" + std::string(item) + "'";
         return false;
       }
-    } else if constexpr (std::is_same<Tp, float>::value ||
-                         std::is_same<Tp, double>::value) {
-      try {
-        value_ = std::stod(std::string(text));
-      } catch (const std::invalid_argument &ia) {
-        err = "not a float";
+      bits |= bit;
+    }
+    bits_ = bits;
+    return true;
+  }
+  std::string ToString() const {
+    std::string out;
+    for (size_t i = 0; names_ && i < names_->size(); ++i) {
+      if (bits_ & Bit(static_cast<unsigned>(i))) {
+        if (!out.empty()) {
+          out += ',';
+        }
+        out += (*names_)[i];
+      }
+    }
+    return out;
+  }
+
+private:
+  // the registered names are shared by every copy of the value
+  std::shared_ptr<const std::vector<std::string>> names_;
+  uint64_t bits_ = 0;
+};
+
+/* IpRangeListValue is a list of IPv4 and IPv6 CIDR blocks, such as
+   "10.0.0.0/8,192.168.1.7,2001:db8::/32". Entries may also be written as
+   inclusive ranges like "10.0.0.5-10.0.0.9". IPv6 addresses may end in a
+   dotted quad, as in "::ffff:10.0.0.0/104". Entries are parsed in place.
+   Overlapping and adjacent ranges are merged into sorted interval arrays,
+   which contains searches with a branchless binary search. */
+class IpRangeListValue {
+public:
+  static constexpr const char *kTypeName = "iprangelist";
+
+  /* V6 is an IPv6 address as two big-endian halves. */
+  struct V6 {
+    uint64_t hi;
+    uint64_t lo;
+    bool operator<(const V6 &o) const {
+      return hi < o.hi || (hi == o.hi && lo < o.lo);
+    }
+    bool operator<=(const V6 &o) const { return !(o < *this); }
+    bool operator==(const V6 &o) const { return hi == o.hi && lo == o.lo; }
+  };
+
+  /* contains reports whether the IPv4 address, in host byte order, is in one
+     of the ranges. */
+  bool contains(uint32_t addr) const {
+    size_t i = LastNotAbove(v4_lo_.data(), v4_lo_.size(), addr);
+    return i < v4_lo_.size() && v4_lo_[i] <= addr && addr <= v4_hi_[i];
+  }
+  /* contains reports whether the IPv6 address is in one of the ranges. */
+  bool contains(const V6 &addr) const {
+    size_t i = LastNotAbove(v6_lo_.data(), v6_lo_.size(), addr);
+    return i < v6_lo_.size() && v6_lo_[i] <= addr && addr <= v6_hi_[i];
+  }
+  /* contains parses a textual IPv4 or IPv6 address and reports whether it is
+     in one of the ranges. Malformed addresses are never contained. */
+  bool contains(std::string_view addr) const {
+    uint32_t v4;
+    V6 v6;
+    if (ParseV4(addr, v4)) {
+      return contains(v4);
+    }
+    return ParseV6(addr, v6) && contains(v6);
+  }
+  /* size returns the number of merged ranges. */
+  size_t size() const { return v4_lo_.size() + v6_lo_.size(); }
+
+  static bool ParseV4(std::string_view s, uint32_t &out) {
+    uint32_t addr = 0;
+    size_t i = 0;
+    for (int part = 0; part < 4; ++part) {
+      if (part > 0) {
+        if (i >= s.size() || s[i] != '.') {
+          return false;
+        }
+        ++i;
+      }
+      size_t start = i;
+      uint32_t v = 0;
+      while (i < s.size() && i - start < 3 && s[i] >= '0' && s[i] <= '9') {
+        v = v * 10 + static_cast<uint32_t>(s[i++] - '0');
+      }
+      if (i == start || v > 255) {
         return false;
-      } catch (const std::out_of_range &oor) {
-        err = "out of range for float";
+      }
+      addr = addr << 8 | v;
+    }
+    if (i != s.size()) {
+      return false;
+    }
+    out = addr;
+    return true;
+  }
+
+  static bool ParseV6(std::string_view s, V6 &out) {
+    uint16_t groups[8] = {};
+    int n = 0;
+    int gap = -1;
+    size_t i = 0;
+    if (s.size() >= 2 && s[0] == ':' && s[1] == ':') {
+      gap = 0;
+      i = 2;
+    } else if (s.empty()) {
+      return false;
+    }
+    while (i < s.size()) {
+      // the last 32 bits may be a dotted quad, as in ::ffff:192.0.2.1
+      // (RFC 4291 section 2.2.3)
+      std::string_view rest = s.substr(i);
+      if (rest.find('.') != std::string_view::npos &&
+          rest.find(':') == std::string_view::npos) {
+        uint32_t v4;
+        if (n > 6 || !ParseV4(rest, v4)) {
+          return false;
+        }
+        groups[n++] = static_cast<uint16_t>(v4 >> 16);
+        groups[n++] = static_cast<uint16_t>(v4);
+        break;
+      }
+      size_t start = i;
+      uint32_t v = 0;
+      while (i < s.size() && i - start < 4 && HexDigit(s[i]) >= 0) {
+        v = v << 4 | static_cast<uint32_t>(HexDigit(s[i++]));
+      }
+      if (i == start || n == 8) {
         return false;
       }
-    } else if constexpr (std::is_same<Tp, bool>::value) {
-      // supports true/false, 1/0, yes/no
-      std::string lower_text;
-      for (char c : text) {
-        lower_text += std::tolower(c);
+      groups[n++] = static_cast<uint16_t>(v);
+      if (i == s.size()) {
+        break;
+      }
+      if (s[i++] != ':' || i == s.size()) {
+        return false;
       }
+      if (s[i] == ':') {
+        if (gap >= 0) {
+          return false;
+        }
+        gap = n;
+        ++i;
+      }
+    }
+    if (gap < 0 ? n != 8 : n > 7) {
+      return false;
+    }
+    uint16_t full[8] = {};
+    int tail = gap < 0 ? 0 : n - gap;
+    for (int k = 0; k < n - tail; ++k) {
+      full[k] = groups[k];
+    }
+    for (int k = 0; k < tail; ++k) {
+      full[8 - tail + k] = groups[gap + k];
+    }
+    out = V6{0, 0};
+    for (int k = 0; k < 4; ++k) {
+      out.hi = out.hi << 16 | full[k];
+      out.lo = out.lo << 16 | full[4 + k];
+    }
+    return true;
+  }
 
-      if (lower_text == "true" || lower_text == "1" || lower_text == "yes" ||
-          lower_text == "on") {
-        value_ = true;
-      } else if (lower_text == "false" || lower_text == "0" ||
-                 lower_text == "no" || lower_text == "off") {
-        value_ = false;
-      } else {
-        err = "invalid boolean value, accepts true/false, 1/0, yes/no, on/off";
+  bool Parse(std::string_view text, std::string &err) {
+    std::vector<std::pair<uint32_t, uint32_t>> v4;
+    std::vector<std::pair<V6, V6>> v6;
+    size_t pos = 0;
+    while (pos < text.size()) {
+      size_t comma = text.find(',', pos);
+      if (comma == std::string_view::npos) {
+        comma = text.size();
+      }
+      std::string_view item = text.substr(pos, comma - pos);
+      pos = comma + 1;
+      if (item.empty()) {
+        continue;
+      }
+      if (!ParseEntry(item, v4, v6)) {
+        err = "invalid address range '" + std::string(item) + "'";
         return false;
       }
+    }
+    Merge(
+        v4,
+        [](uint32_t hi, uint32_t lo) { return hi == UINT32_MAX || hi + 1 >= lo; },
+        v4_lo_, v4_hi_);
+    Merge(v6,
+          [](const V6 &hi, const V6 &lo) {
+            V6 next = Next(hi);
+            return (hi.hi == UINT64_MAX && hi.lo == UINT64_MAX) || lo <= next;
+          },
+          v6_lo_, v6_hi_);
+    return true;
+  }
 
-    } else if constexpr (std::is_same<Tp, std::string>::value) {
-      value_ = text;
-    } else {
-      err = "set unknown type";
+  std::string ToString() const {
+    std::string out;
+    auto sep = [&] {
+      if (!out.empty()) {
+        out += ',';
+      }
+    };
+    for (size_t i = 0; i < v4_lo_.size(); ++i) {
+      sep();
+      AppendV4(out, v4_lo_[i]);
+      if (v4_hi_[i] != v4_lo_[i]) {
+        out += '-';
+        AppendV4(out, v4_hi_[i]);
+      }
+    }
+    for (size_t i = 0; i < v6_lo_.size(); ++i) {
+      sep();
+      AppendV6(out, v6_lo_[i]);
+      if (!(v6_hi_[i] == v6_lo_[i])) {
+        out += '-';
+        AppendV6(out, v6_hi_[i]);
+      }
+    }
+    return out;
+  }
+
+private:
+  static int HexDigit(char c) {
+    if (c >= '0' && c <= '9') {
+      return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+      return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+      return c - 'A' + 10;
+    }
+    return -1;
+  }
+
+  static V6 Next(const V6 &v) {
+    return v.lo == UINT64_MAX ? V6{v.hi + 1, 0} : V6{v.hi, v.lo + 1};
+  }
+
+  // LastNotAbove returns the index of the last element <= x, or n if there
+  // is none. The loop compiles to conditional moves.
+  template <typename K>
+  static size_t LastNotAbove(const K *base, size_t n, const K &x) {
+    if (n == 0 || x < base[0]) {
+      return n;
+    }
+    const K *first = base;
+    while (n > 1) {
+      size_t half = n / 2;
+      first = first[half] <= x ? first + half : first;
+      n -= half;
+    }
+    return static_cast<size_t>(first - base);
+  }
+
+  static bool ParsePrefix(std::string_view s, unsigned max, unsigned &out) {
+    if (s.empty() || s.size() > 3) {
       return false;
     }
-    return true;
+    unsigned v = 0;
+    for (char c : s) {
+      if (c < '0' || c > '9') {
+        return false;
+      }
+      v = v * 10 + static_cast<unsigned>(c - '0');
+    }
+    out = v;
+    return v <= max;
   }
 
-  std::string ToString() const override {
-    if constexpr (std::is_same<T, bool>::value) {
-      return value_ ? "true" : "false";
-    } else if constexpr (std::is_same<T, std::string>::value) {
-      return value_;
-    } else {
-      return std::to_string(value_);
+  static bool ParseEntry(std::string_view item,
+                         std::vector<std::pair<uint32_t, uint32_t>> &v4,
+                         std::vector<std::pair<V6, V6>> &v6) {
+    size_t dash = item.find('-');
+    if (dash != std::string_view::npos) {
+      std::string_view a = item.substr(0, dash), b = item.substr(dash + 1);
+      uint32_t lo4, hi4;
+      V6 lo6, hi6;
+      if (ParseV4(a, lo4) && ParseV4(b, hi4) && lo4 <= hi4) {
+        v4.emplace_back(lo4, hi4);
+        return true;
+      }
+      if (ParseV6(a, lo6) && ParseV6(b, hi6) && lo6 <= hi6) {
+        v6.emplace_back(lo6, hi6);
+        return true;
+      }
+      return false;
+    }
+    size_t slash = item.find('/');
+    std::string_view addr = item.substr(0, slash);
+    uint32_t a4;
+    V6 a6;
+    unsigned len;
+    if (ParseV4(addr, a4)) {
+      if (slash == std::string_view::npos) {
+        len = 32;
+      } else if (!ParsePrefix(item.substr(slash + 1), 32, len)) {
+        return false;
+      }
+      uint32_t host = len == 0 ? UINT32_MAX : (uint32_t(1) << (32 - len)) - 1;
+      v4.emplace_back(a4 & ~host, a4 | host);
+      return true;
+    }
+    if (ParseV6(addr, a6)) {
+      if (slash == std::string_view::npos) {
+        len = 128;
+      } else if (!ParsePrefix(item.substr(slash + 1), 128, len)) {
+        return false;
+      }
+      auto host_bits = [](unsigned bits) {
+        return bits >= 64 ? UINT64_MAX
+                          : bits == 0 ? 0 : (uint64_t(1) << bits) - 1;
+      };
+      V6 host{host_bits(len >= 64 ? 0 : 64 - len),
+              host_bits(128 - len > 64 ? 64 : 128 - len)};
+      v6.emplace_back(V6{a6.hi & ~host.hi, a6.lo & ~host.lo},
+                      V6{a6.hi | host.hi, a6.lo | host.lo});
+      return true;
     }
+    return false;
   }
 
-  std::string TypeName() const override { return type_name_; }
-  const T &Get() const { return value_; }
-  virtual IValue *clone() const override { return new ValueAdapter<T>(value_); }
+  template <typename K, typename Touches>
+  static void Merge(std::vector<std::pair<K, K>> &ranges, Touches touches,
+                    std::vector<K> &lo, std::vector<K> &hi) {
+    std::sort(ranges.begin(), ranges.end(),
+              [](const auto &a, const auto &b) { return a.first < b.first; });
+    lo.clear();
+    hi.clear();
+    for (const auto &r : ranges) {
+      if (!hi.empty() && touches(hi.back(), r.first)) {
+        if (hi.back() < r.second) {
+          hi.back() = r.second;
+        }
+      } else {
+        lo.push_back(r.first);
+        hi.push_back(r.second);
+      }
+    }
+  }
+
+  static void AppendV4(std::string &out, uint32_t a) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      out += std::to_string((a >> shift) & 0xff);
+      if (shift > 0) {
+        out += '.';
+      }
+    }
+  }
+
+  static void AppendV6(std::string &out, const V6 &a) {
+    static const char kHex[] = "0123456789abcdef";
+    for (int k = 0; k < 8; ++k) {
+      uint64_t half = k < 4 ? a.hi : a.lo;
+      unsigned g = static_cast<unsigned>(half >> (48 - 16 * (k % 4))) & 0xffff;
+      if (k > 0) {
+        out += ':';
+      }
+      bool started = false;
+      for (int shift = 12; shift >= 0; shift -= 4) {
+        unsigned d = (g >> shift) & 0xf;
+        if (d || started || shift == 0) {
+          out += kHex[d];
+          started = true;
+        }
+      }
+    }
+  }
+
+  std::vector<uint32_t> v4_lo_;
+  std::vector<uint32_t> v4_hi_;
+  std::vector<V6> v6_lo_;
+  std::vector<V6> v6_hi_;
+};
+
+/* JsonValue is a JSON document, such as a routing table or a retry policy.
+   Parse checks the structure in one pass over the text and keeps the text.
+   The tape used for navigation is built on the first call to root() and
+   shared by every copy of the value. Views read strings and numbers straight
+   from the original text. */
+class JsonValue {
+public:
+  static constexpr const char *kTypeName = "json";
+  /* kMaxSize bounds the document length so that tape entries fit in 32
+     bits. */
+  static constexpr size_t kMaxSize = size_t(1) << 28;
+
+  enum class Kind : uint8_t {
+    kNull,
+    kFalse,
+    kTrue,
+    kNumber,
+    kString,
+    kArray,
+    kObject
+  };
+
+private:
+  // Node is one tape entry. Values are stored in document order and
+  // object keys precede their values. next is the index just past the
+  // subtree, so siblings are walked without touching their children.
+  struct Node {
+    uint32_t begin;
+    uint32_t len;
+    uint32_t next;
+    // kind in bits 0-2, escaped-string flag in bit 3, child count above
+    uint32_t info;
+  };
+  struct Doc {
+    std::string text;
+    size_t nodes = 0;
+    mutable std::once_flag built;
+    mutable std::vector<Node> tape;
+  };
+
+public:
+  /* View is a read-only position in a document. Lookups that miss, or that
+     do not match the kind of the value, return an invalid view, so chains
+     like root()["retry"]["max"].as_int64(3) need no checks in between.
+     Views stay valid while the JsonValue they came from is alive. */
+  class View {
+  public:
+    View() = default;
+
+    /* valid reports whether the view refers to a value. */
+    bool valid() const { return doc_ != nullptr; }
+    /* kind returns the kind of the value; invalid views are kNull. */
+    Kind kind() const {
+      return doc_ ? static_cast<Kind>(node().info & 7) : Kind::kNull;
+    }
+    /* size returns the number of array elements or object members. */
+    size_t size() const {
+      Kind k = kind();
+      return k == Kind::kArray || k == Kind::kObject ? node().info >> 4 : 0;
+    }
+    /* operator[] returns the value of the object member named key. If the
+       key repeats, the first member wins. */
+    View operator[](std::string_view key) const {
+      if (kind() != Kind::kObject) {
+        return View();
+      }
+      const auto &tape = doc_->tape;
+      for (uint32_t i = index_ + 1; i < node().next; i = tape[i + 1].next) {
+        View k(doc_, i);
+        if (tape[i].info & kEscaped ? k.unescaped() == key : k.str() == key) {
+          return View(doc_, i + 1);
+        }
+      }
+      return View();
+    }
+    /* operator[] returns array element i, or the value of object member
+       i. It steps over the i siblings before it; use begin() and end() to
+       visit them all. */
+    View operator[](size_t i) const {
+      uint32_t c = Child(i);
+      if (c == 0) {
+        return View();
+      }
+      return View(doc_, kind() == Kind::kObject ? c + 1 : c);
+    }
+    /* key returns the key of object member i, escapes as written. */
+    std::string_view key(size_t i) const {
+      uint32_t c = kind() == Kind::kObject ? Child(i) : 0;
+      return c == 0 ? std::string_view() : View(doc_, c).str();
+    }
+    bool as_bool(bool def = false) const {
+      Kind k = kind();
+      return k == Kind::kTrue ? true : k == Kind::kFalse ? false : def;
+    }
+    /* as_int64 returns the number if it is an integer that fits. */
+    int64_t as_int64(int64_t def = 0) const {
+      if (kind() != Kind::kNumber) {
+        return def;
+      }
+      std::string_view r = raw();
+      int64_t v;
+      auto [ptr, ec] = std::from_chars(r.data(), r.data() + r.size(), v);
+      return ec == std::errc() && ptr == r.data() + r.size() ? v : def;
+    }
+    double as_double(double def = 0) const {
+      if (kind() != Kind::kNumber) {
+        return def;
+      }
+      std::string_view r = raw();
+      double v;
+      auto [ptr, ec] = std::from_chars(r.data(), r.data() + r.size(), v);
+      return ec == std::errc() ? v : def;
+    }
+    /* str returns the contents of a string, escapes as written. */
+    std::string_view str() const {
+      if (kind() != Kind::kString) {
+        return std::string_view();
+      }
+      std::string_view r = raw();
+      return r.substr(1, r.size() - 2);
+    }
+    /* unescaped returns the contents of a string with escapes decoded. */
+    std::string unescaped() const {
+      std::string_view s = str();
+      if (!doc_ || !(node().info & kEscaped)) {
+        return std::string(s);
+      }
+      return JsonValue::Unescape(s);
+    }
+    /* raw returns the text of the value as it appears in the document. */
+    std::string_view raw() const {
+      if (!doc_) {
+        return std::string_view();
+      }
+      return std::string_view(doc_->text).substr(node().begin, node().len);
+    }
+
+    /* iterator visits array elements, or object member values in order.
+       Stepping to the next one costs the same however large the current
+       one is. */
+    class iterator {
+    public:
+      View operator*() const { return View(doc_, object_ ? i_ + 1 : i_); }
+      /* key returns the key of the current object member. */
+      std::string_view key() const { return View(doc_, i_).str(); }
+      iterator &operator++() {
+        i_ = doc_->tape[object_ ? i_ + 1 : i_].next;
+        return *this;
+      }
+      bool operator!=(const iterator &o) const { return i_ != o.i_; }
+      bool operator==(const iterator &o) const { return i_ == o.i_; }
+
+    private:
+      friend class View;
+      iterator(const Doc *doc, uint32_t i, bool object)
+          : doc_(doc), i_(i), object_(object) {}
+      const Doc *doc_;
+      uint32_t i_;
+      bool object_;
+    };
+    iterator begin() const {
+      return size() == 0 ? end()
+                         : iterator(doc_, index_ + 1, kind() == Kind::kObject);
+    }
+    iterator end() const {
+      return iterator(doc_, doc_ ? node().next : 0, false);
+    }
+
+  private:
+    friend class JsonValue;
+    View(const Doc *doc, uint32_t index) : doc_(doc), index_(index) {}
+    const Node &node() const { return doc_->tape[index_]; }
+    // Child returns the tape index of element or member i, or 0.
+    uint32_t Child(size_t i) const {
+      if (i >= size()) {
+        return 0;
+      }
+      const auto &tape = doc_->tape;
+      bool object = kind() == Kind::kObject;
+      uint32_t c = index_ + 1;
+      for (; i > 0; --i) {
+        c = tape[object ? c + 1 : c].next;
+      }
+      return c;
+    }
+
+    const Doc *doc_ = nullptr;
+    uint32_t index_ = 0;
+  };
+
+  /* root returns a view of the top-level value, building the tape if this
+     is the first access to the document. */
+  View root() const {
+    if (!doc_) {
+      return View();
+    }
+    std::call_once(doc_->built, [this] { BuildTape(*doc_); });
+    return View(doc_.get(), 0);
+  }
+  /* text returns the document as given. */
+  std::string_view text() const {
+    return doc_ ? std::string_view(doc_->text) : std::string_view();
+  }
+
+  bool Parse(std::string_view text, std::string &err) {
+    size_t offset;
+    return Parse(text, err, offset);
+  }
+  /* Parse also sets offset to the byte at which an invalid document was
+     rejected, or to npos. */
+  bool Parse(std::string_view text, std::string &err, size_t &offset) {
+    offset = std::string::npos;
+    if (text.size() >= kMaxSize) {
+      err = "JSON document too large";
+      return false;
+    }
+    size_t pos = 0;
+    size_t nodes = 0;
+    const char *what = Validate(text, pos, nodes);
+    if (what) {
+      offset = pos;
+      err = "invalid JSON at byte " + std::to_string(pos) + ": " + what;
+      return false;
+    }
+    auto doc = std::make_shared<Doc>();
+    doc->text = text;
+    doc->nodes = nodes;
+    doc_ = std::move(doc);
+    return true;
+  }
+  std::string ToString() const { return std::string(text()); }
+
+private:
+  static constexpr uint32_t kEscaped = 8;
+
+  static bool IsSpace(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+  }
+  static bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+  static int HexDigit(char c) {
+    if (IsDigit(c)) {
+      return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+      return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+      return c - 'A' + 10;
+    }
+    return -1;
+  }
+
+  // ScanString advances i from an opening quote to just past the closing
+  // one. Runs of plain characters are skipped 16 bytes at a time with SSE2.
+  // On failure i is the offending byte.
+  static const char *ScanString(std::string_view s, size_t &i,
+                                bool &escaped) {
+    size_t n = s.size();
+    ++i;
+    for (;;) {
+#if defined(__SSE2__)
+      const __m128i quote = _mm_set1_epi8('"');
+      const __m128i slash = _mm_set1_epi8('\\');
+      const __m128i ctrl = _mm_set1_epi8(0x1f);
+      while (i + 16 <= n) {
+        __m128i v =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(s.data() + i));
+        __m128i hit = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, slash)),
+            _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(hit));
+        if (mask != 0) {
+          i += detail::CountTrailingZeros(mask);
+          break;
+        }
+        i += 16;
+      }
+#endif
+      while (i < n && s[i] != '"' && s[i] != '\\' &&
+             static_cast<unsigned char>(s[i]) >= 0x20) {
+        ++i;
+      }
+      if (i == n) {
+        return "unterminated string";
+      }
+      if (s[i] == '"') {
+        ++i;
+        return nullptr;
+      }
+      if (s[i] != '\\') {
+        return "control character in string";
+      }
+      escaped = true;
+      if (++i == n) {
+        return "unterminated string";
+      }
+      switch (s[i]) {
+      case '"':
+      case '\\':
+      case '/':
+      case 'b':
+      case 'f':
+      case 'n':
+      case 'r':
+      case 't':
+        ++i;
+        break;
+      case 'u':
+        for (int k = 0; k < 4; ++k) {
+          if (++i == n || HexDigit(s[i]) < 0) {
+            return "invalid \\u escape";
+          }
+        }
+        ++i;
+        break;
+      default:
+        return "invalid escape";
+      }
+    }
+  }
+
+  // ScanNumber advances i past a number in the JSON grammar.
+  static const char *ScanNumber(std::string_view s, size_t &i) {
+    size_t n = s.size();
+    if (s[i] == '-') {
+      ++i;
+    }
+    if (i == n || !IsDigit(s[i])) {
+      return "invalid number";
+    }
+    if (s[i++] != '0') {
+      while (i < n && IsDigit(s[i])) {
+        ++i;
+      }
+    }
+    if (i < n && s[i] == '.') {
+      if (++i == n || !IsDigit(s[i])) {
+        return "invalid number";
+      }
+      while (i < n && IsDigit(s[i])) {
+        ++i;
+      }
+    }
+    if (i < n && (s[i] == 'e' || s[i] == 'E')) {
+      if (++i < n && (s[i] == '+' || s[i] == '-')) {
+        ++i;
+      }
+      if (i == n || !IsDigit(s[i])) {
+        return "invalid number";
+      }
+      while (i < n && IsDigit(s[i])) {
+        ++i;
+      }
+    }
+    return nullptr;
+  }
+
+  // Validate checks that s holds exactly one JSON value and counts the tape
+  // entries it will need. It returns nullptr, or a description of the first
+  // error with i at its byte offset. Nesting is tracked in a string of
+  // open brackets instead of recursion, so depth is not limited by the
+  // stack.
+  static const char *Validate(std::string_view s, size_t &i, size_t &nodes) {
+    size_t n = s.size();
+    std::string open;
+    bool want_key = false;
+    i = 0;
+    auto skip_space = [&] {
+      while (i < n && IsSpace(s[i])) {
+        ++i;
+      }
+    };
+    for (;;) {
+      skip_space();
+      if (want_key) {
+        if (i == n || s[i] != '"') {
+          return "expected object key";
+        }
+        bool escaped = false;
+        if (const char *what = ScanString(s, i, escaped)) {
+          return what;
+        }
+        ++nodes;
+        skip_space();
+        if (i == n || s[i] != ':') {
+          return "expected ':'";
+        }
+        ++i;
+        skip_space();
+        want_key = false;
+      }
+      if (i == n) {
+        return "unexpected end of input";
+      }
+      ++nodes;
+      char c = s[i];
+      if (c == '{' || c == '[') {
+        ++i;
+        skip_space();
+        if (i < n && s[i] == (c == '{' ? '}' : ']')) {
+          ++i;
+        } else {
+          open += c;
+          want_key = c == '{';
+          continue;
+        }
+      } else if (c == '"') {
+        bool escaped = false;
+        if (const char *what = ScanString(s, i, escaped)) {
+          return what;
+        }
+      } else if (c == '-' || IsDigit(c)) {
+        if (const char *what = ScanNumber(s, i)) {
+          return what;
+        }
+      } else {
+        std::string_view word = c == 't'   ? "true"
+                                : c == 'f' ? "false"
+                                : c == 'n' ? "null"
+                                           : "";
+        if (word.empty() || s.substr(i, word.size()) != word) {
+          return "unexpected character";
+        }
+        i += word.size();
+      }
+      // a value is complete; close containers until one continues
+      for (;;) {
+        skip_space();
+        if (open.empty()) {
+          return i == n ? nullptr : "unexpected data after value";
+        }
+        bool object = open.back() == '{';
+        if (i == n) {
+          return "unexpected end of input";
+        }
+        if (s[i] == ',') {
+          ++i;
+          want_key = object;
+          break;
+        }
+        if (s[i] != (object ? '}' : ']')) {
+          return object ? "expected ',' or '}'" : "expected ',' or ']'";
+        }
+        ++i;
+        open.pop_back();
+      }
+    }
+  }
+
+  // BuildTape indexes a document that Validate accepted.
+  static void BuildTape(const Doc &doc) {
+    std::string_view s = doc.text;
+    auto &tape = doc.tape;
+    tape.reserve(doc.nodes);
+    std::vector<uint32_t> open;
+    bool key_next = false;
+    auto add = [&](Kind kind, size_t begin, size_t end, uint32_t flags) {
+      bool key = key_next;
+      key_next = false;
+      if (!open.empty() && !key) {
+        tape[open.back()].info += 1 << 4;
+      }
+      uint32_t index = static_cast<uint32_t>(tape.size());
+      tape.push_back(Node{static_cast<uint32_t>(begin),
+                          static_cast<uint32_t>(end - begin), index + 1,
+                          static_cast<uint32_t>(kind) | flags});
+      return index;
+    };
+    for (size_t i = 0; i < s.size();) {
+      char c = s[i];
+      size_t begin = i;
+      switch (c) {
+      case '{':
+      case '[':
+        open.push_back(
+            add(c == '{' ? Kind::kObject : Kind::kArray, i, i + 1, 0));
+        key_next = c == '{';
+        ++i;
+        break;
+      case '}':
+      case ']': {
+        Node &node = tape[open.back()];
+        open.pop_back();
+        key_next = false;
+        node.len = static_cast<uint32_t>(i + 1 - node.begin);
+        node.next = static_cast<uint32_t>(tape.size());
+        ++i;
+        break;
+      }
+      case ',':
+        key_next = !open.empty() &&
+                   static_cast<Kind>(tape[open.back()].info & 7) ==
+                       Kind::kObject;
+        ++i;
+        break;
+      case '"': {
+        bool escaped = false;
+        ScanString(s, i, escaped);
+        add(Kind::kString, begin, i, escaped ? kEscaped : 0);
+        break;
+      }
+      case 't':
+        add(Kind::kTrue, i, i + 4, 0);
+        i += 4;
+        break;
+      case 'f':
+        add(Kind::kFalse, i, i + 5, 0);
+        i += 5;
+        break;
+      case 'n':
+        add(Kind::kNull, i, i + 4, 0);
+        i += 4;
+        break;
+      default:
+        if (c == '-' || IsDigit(c)) {
+          ScanNumber(s, i);
+          add(Kind::kNumber, begin, i, 0);
+        } else {
+          // white space and ':'
+          ++i;
+        }
+      }
+    }
+  }
+
+  static void AppendUtf8(std::string &out, uint32_t cp) {
+    if (cp < 0x80) {
+      out += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+      out += static_cast<char>(0xc0 | cp >> 6);
+      out += static_cast<char>(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+      out += static_cast<char>(0xe0 | cp >> 12);
+      out += static_cast<char>(0x80 | (cp >> 6 & 0x3f));
+      out += static_cast<char>(0x80 | (cp & 0x3f));
+    } else {
+      out += static_cast<char>(0xf0 | cp >> 18);
+      out += static_cast<char>(0x80 | (cp >> 12 & 0x3f));
+      out += static_cast<char>(0x80 | (cp >> 6 & 0x3f));
+      out += static_cast<char>(0x80 | (cp & 0x3f));
+    }
+  }
+
+  // Unescape decodes the escapes of validated string contents. Unpaired
+  // surrogates become U+FFFD.
+  static std::string Unescape(std::string_view s) {
+    std::string out;
+    out.reserve(s.size());
+    auto hex4 = [&](size_t at) {
+      uint32_t v = 0;
+      for (size_t k = 0; k < 4; ++k) {
+        v = v << 4 | static_cast<uint32_t>(HexDigit(s[at + k]));
+      }
+      return v;
+    };
+    for (size_t i = 0; i < s.size(); ++i) {
+      if (s[i] != '\\') {
+        out += s[i];
+        continue;
+      }
+      char e = s[++i];
+      switch (e) {
+      case 'b':
+        out += '\b';
+        break;
+      case 'f':
+        out += '\f';
+        break;
+      case 'n':
+        out += '\n';
+        break;
+      case 'r':
+        out += '\r';
+        break;
+      case 't':
+        out += '\t';
+        break;
+      case 'u': {
+        uint32_t cp = hex4(i + 1);
+        i += 4;
+        if (cp >= 0xd800 && cp < 0xdc00 && i + 6 < s.size() &&
+            s[i + 1] == '\\' && s[i + 2] == 'u') {
+          uint32_t lo = hex4(i + 3);
+          if (lo >= 0xdc00 && lo < 0xe000) {
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+            i += 6;
+          }
+        }
+        AppendUtf8(out, cp >= 0xd800 && cp < 0xe000 ? 0xfffd : cp);
+        break;
+      }
+      default:
+        out += e;
+      }
+    }
+    return out;
+  }
+
+  std::shared_ptr<const Doc> doc_;
+};
+
+namespace detail {
+
+// HasParseOffset detects value types whose Parse also reports an offset.
+template <typename T, typename = void>
+struct HasParseOffset : std::false_type {};
+template <typename T>
+struct HasParseOffset<
+    T, std::void_t<decltype(std::declval<T &>().Parse(
+           std::string_view(), std::declval<std::string &>(),
+           std::declval<size_t &>()))>> : std::true_type {};
+
+} // namespace detail
+
+template <typename T> class ValueAdapter : public IValue {
+public:
+  using Tp = std::remove_cv_t<std::decay_t<T>>;
+  explicit ValueAdapter(T val) : value_(std::move(val)) {
+    if constexpr (std::is_same<Tp, int64_t>::value) {
+      type_name_ = "int";
+    } else if constexpr (std::is_same<Tp, int32_t>::value) {
+      type_name_ = "int32";
+    } else if constexpr (std::is_same<Tp, uint32_t>::value) {
+      type_name_ = "uint32";
+    } else if constexpr (std::is_same<Tp, uint64_t>::value) {
+      type_name_ = "uint64";
+    } else if constexpr (std::is_same<Tp, float>::value) {
+      type_name_ = "float32";
+    } else if constexpr (std::is_same<Tp, double>::value) {
+      type_name_ = "float";
+    } else if constexpr (std::is_same<Tp, bool>::value) {
+      type_name_ = "bool";
+    } else if constexpr (std::is_same<Tp, std::string>::value) {
+      type_name_ = "string";
+    } else if constexpr (std::is_class<Tp>::value) {
+      type_name_ = Tp::kTypeName;
+    }
+  };
+  bool Set(std::string_view text, std::string &err) override {
+    size_t offset;
+    return SetWithOffset(text, err, offset);
+  }
+  bool SetWithOffset(std::string_view text, std::string &err,
+                     size_t &offset) override {
+    offset = std::string::npos;
+    if constexpr (std::is_class<Tp>::value) {
+      // checked before conversion, so no partial value is ever built
+      if (strict_utf8_) {
+        size_t bad = detail::FindInvalidUtf8(text);
+        if (bad != std::string_view::npos) {
+          offset = bad;
+          err = "invalid UTF-8 at byte " + std::to_string(bad);
+          return false;
+        }
+      }
+    }
+    if constexpr (std::is_integral<Tp>::value &&
+                  !std::is_same<Tp, bool>::value) {
+      // every integer kind accepts what std::stoll, which Int has always
+      // used, accepts: leading whitespace, a '+' sign and trailing text
+      // after the digits. Unsigned kinds reject a '-' sign. The range is
+      // checked once, here.
+      const char *first = text.data();
+      const char *last = first + text.size();
+      while (first != last &&
+             std::isspace(static_cast<unsigned char>(*first))) {
+        ++first;
+      }
+      if (first != last && *first == '+') {
+        ++first;
+        if (first == last || *first == '-') {
+          err = "not an integer";
+          return false;
+        }
+      }
+      Tp v;
+      auto [ptr, ec] = std::from_chars(first, last, v);
+      if (ec == std::errc::result_out_of_range) {
+        err = std::string("out of range for ") +
+              (std::is_same<Tp, int64_t>::value ? "int64_t" : type_name_);
+        return false;
+      }
+      if (ec != std::errc()) {
+        err = "not an integer";
+        return false;
+      }
+      (void)ptr;
+      value_ = v;
+    } else if constexpr (std::is_same<Tp, float>::value) {
+      double v;
+      try {
+        v = std::stod(std::string(text));
+      } catch (const std::invalid_argument &ia) {
+        err = "not a float";
+        return false;
+      } catch (const std::out_of_range &oor) {
+        err = "out of range for float32";
+        return false;
+      }
+      if (std::isfinite(v) &&
+          std::fabs(v) > std::numeric_limits<float>::max()) {
+        err = "out of range for float32";
+        return false;
+      }
+      value_ = static_cast<float>(v);
+    } else if constexpr (std::is_same<Tp, double>::value) {
+      try {
+        value_ = std::stod(std::string(text));
+      } catch (const std::invalid_argument &ia) {
+        err = "not a float";
+        return false;
+      } catch (const std::out_of_range &oor) {
+        err = "out of range for float";
+        return false;
+      }
+    } else if constexpr (std::is_same<Tp, bool>::value) {
+      // supports true/false, 1/0, yes/no
+      std::string lower_text;
+      for (char c : text) {
+        lower_text += std::tolower(c);
+      }
+
+      if (lower_text == "true" || lower_text == "1" || lower_text == "yes" ||
+          lower_text == "on") {
+        value_ = true;
+      } else if (lower_text == "false" || lower_text == "0" ||
+                 lower_text == "no" || lower_text == "off") {
+        value_ = false;
+      } else {
+        err = "invalid boolean value, accepts true/false, 1/0, yes/no, on/off";
+        return false;
+      }
+
+    } else if constexpr (std::is_same<Tp, std::string>::value) {
+      value_ = text;
+    } else if constexpr (std::is_class<Tp>::value) {
+      // value types such as StringSetValue parse themselves
+      if constexpr (detail::HasParseOffset<Tp>::value) {
+        return value_.Parse(text, err, offset);
+      } else {
+        return value_.Parse(text, err);
+      }
+    } else {
+      err = "set unknown type";
+      return false;
+    }
+    return true;
+  }
+
+  std::string ToString() const override {
+    if constexpr (std::is_same<T, bool>::value) {
+      return value_ ? "true" : "false";
+    } else if constexpr (std::is_same<T, std::string>::value) {
+      return value_;
+    } else if constexpr (std::is_class<T>::value) {
+      return value_.ToString();
+    } else {
+      return std::to_string(value_);
+    }
+  }
+
+  std::string TypeName() const override { return type_name_; }
+  const T &Get() const { return value_; }
+  virtual IValue *clone() const override {
+    auto copy = new ValueAdapter<T>(value_);
+    copy->strict_utf8_ = strict_utf8_;
+    return copy;
+  }
+  /* SetStrictUtf8 makes Set reject text that is not valid UTF-8. */
+  void SetStrictUtf8(bool on) { strict_utf8_ = on; }
+  void Encode(std::string &out) const override {
+    if constexpr (std::is_arithmetic<Tp>::value) {
+      // numbers are stored raw, little-endian, so that doubles round-trip
+      // exactly
+      char raw[sizeof(value_)];
+      std::memcpy(raw, &value_, sizeof(value_));
+      detail::SwapToLittleEndian(raw, sizeof(raw));
+      out.append(raw, sizeof(raw));
+    } else {
+      out += ToString();
+    }
+  }
+  bool Decode(std::string_view data, std::string &err) override {
+    if constexpr (std::is_arithmetic<Tp>::value) {
+      if (data.size() != sizeof(value_)) {
+        err = "encoded size mismatch";
+        return false;
+      }
+      if (std::is_same<Tp, bool>::value && data[0] != 0 && data[0] != 1) {
+        err = "invalid encoded bool";
+        return false;
+      }
+      char raw[sizeof(value_)];
+      std::memcpy(raw, data.data(), sizeof(raw));
+      detail::SwapToLittleEndian(raw, sizeof(raw));
+      std::memcpy(&value_, raw, sizeof(value_));
+      return true;
+    } else {
+      return Set(data, err);
+    }
+  }
+  bool DecodeWithOffset(std::string_view data, std::string &err,
+                        size_t &offset) override {
+    if constexpr (std::is_arithmetic<Tp>::value) {
+      offset = std::string::npos;
+      return Decode(data, err);
+    } else {
+      return SetWithOffset(data, err, offset);
+    }
+  }
+
+private:
+  const char *type_name_ = "";
+  T value_;
+  bool strict_utf8_ = false;
+};
+
+struct Flag {
+  std::string name;
+  char short_name = 0;
+  std::string usage;
+  std::unique_ptr<IValue> value;
+  std::unique_ptr<IValue> default_value;
+  bool set = false;
+  /* computed marks a flag defined by FlagSet::Computed. It is found by name
+     but cannot be given on the command line, Set or adopted. */
+  bool computed = false;
+  /* id is the position of the flag in the FlagSet that defines it. */
+  uint32_t id = 0;
+  /* version changes whenever the value may have changed. */
+  std::atomic<uint64_t> version{0};
+
+  /* As returns the value of the flag as type T.
+     It throws std::bad_cast if the type does not match. */
+  template <typename T> const T &As() const {
+    auto va = dynamic_cast<const ValueAdapter<T> *>(value.get());
+    if (!va) {
+      throw std::bad_cast();
+    }
+    return va->Get();
+  }
+};
+
+/* Compiled is a shared handle to an object derived from a flag value, such as
+   a compiled regex. The object is built on first use, rebuilt on the first
+   use after the flag value changes, and shared by every copy of the handle.
+   Get is safe to call from many threads at once; each version of the flag is
+   compiled exactly once. */
+template <typename D> class Compiled {
+public:
+  using Factory = std::function<D(const Flag &)>;
+
+  Compiled() = default;
+  Compiled(const Flag *flag, Factory factory)
+      : state_(std::make_shared<State>(flag, std::move(factory))) {}
+
+  /* Get returns the object for the current flag value. */
+  std::shared_ptr<const D> Get() const {
+    State &st = *state_;
+    uint64_t version = st.flag->version.load(std::memory_order_acquire);
+    if (st.built.load(std::memory_order_acquire) == version) {
+      return std::atomic_load(&st.value);
+    }
+    std::lock_guard<std::mutex> lock(st.mu);
+    version = st.flag->version.load(std::memory_order_acquire);
+    if (st.built.load(std::memory_order_relaxed) != version) {
+      std::atomic_store(&st.value,
+                        std::shared_ptr<const D>(
+                            std::make_shared<D>(st.factory(*st.flag))));
+      st.built.store(version, std::memory_order_release);
+    }
+    return std::atomic_load(&st.value);
+  }
+
+private:
+  struct State {
+    State(const Flag *f, Factory fn) : flag(f), factory(std::move(fn)) {}
+    const Flag *flag;
+    Factory factory;
+    std::mutex mu;
+    std::shared_ptr<const D> value;
+    std::atomic<uint64_t> built{UINT64_MAX};
+  };
+  std::shared_ptr<State> state_;
+};
+
+/* Compile attaches a factory to flag and returns the handle through which
+   the derived object is read. */
+template <typename D, typename Factory>
+Compiled<D> Compile(const Flag *flag, Factory factory) {
+  return Compiled<D>(flag, typename Compiled<D>::Factory(std::move(factory)));
+}
+
+/* ParseRecord is one Parse input read back from a parse log. */
+struct ParseRecord {
+  std::vector<std::string> args;
+  bool has_outcome = false;
+  ParseErrorKind kind = ParseErrorKind::None;
+  std::string flag;
+  /* values is the Snapshot of the flags a successful Parse set. */
+  std::string values;
+};
+
+/* ParseRecorder appends each Parse input, and optionally its outcome, to a
+   compact binary log. The log starts with an 8 byte magic; each record is the
+   varint argc, a varint length plus bytes for every argument, an outcome byte
+   (0xff when outcomes are not recorded) and then the varint length plus bytes
+   of the offending flag name for a failure, or of the Snapshot of the values
+   set for a success. */
+class ParseRecorder {
+public:
+  static constexpr char kMagic[8] = {'C', 'F', 'L', 'G', 'L', 'O', 'G', '2'};
+  static constexpr unsigned char kNoOutcome = 0xff;
+
+  /* ParseRecorder writes to out, which must be opened for binary writing. The
+     recorder does not take ownership of out. */
+  explicit ParseRecorder(std::FILE *out, bool record_outcome = true);
+  /* Record appends one record. pr may be nullptr if the outcome is unknown.
+     values is the Snapshot taken after a successful Parse. */
+  void Record(int argc, char **argv, const ParseResult *pr,
+              std::string_view values = {});
+
+private:
+  std::FILE *out_;
+  bool record_outcome_;
+  std::string buf_;
+};
+
+/* ReadParseLog reads every record of a parse log written by ParseRecorder.
+   It returns false and sets err if the log is malformed. */
+bool ReadParseLog(std::FILE *in, std::vector<ParseRecord> &records,
+                  std::string &err);
+
+/* Sink receives the text printed by PrintUsage and PrintError. */
+class Sink {
+public:
+  virtual ~Sink() = default;
+  /* Write outputs text. */
+  virtual void Write(std::string_view text) = 0;
+};
+
+/* StringSink appends the output to a string. */
+class StringSink : public Sink {
+public:
+  explicit StringSink(std::string &out) : out_(out) {}
+  void Write(std::string_view text) override { out_ += text; }
+
+private:
+  std::string &out_;
+};
+
+#if defined(__unix__) || defined(__APPLE__)
+/* FdSink writes the output to a file descriptor with write(2), for example
+   FdSink(1) for stdout and FdSink(2) for stderr. */
+class FdSink : public Sink {
+public:
+  explicit FdSink(int fd) : fd_(fd) {}
+  void Write(std::string_view text) override {
+    while (!text.empty()) {
+      ssize_t n = ::write(fd_, text.data(), text.size());
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return;
+      }
+      text.remove_prefix(static_cast<size_t>(n));
+    }
+  }
+
+private:
+  int fd_;
+};
+#endif
+
+#if !defined(CPPFLAG_NO_IOSTREAM)
+/* OstreamSink adapts a std::ostream to a Sink. */
+class OstreamSink : public Sink {
+public:
+  explicit OstreamSink(std::ostream &os) : os_(os) {}
+  void Write(std::string_view text) override {
+    os_.write(text.data(), static_cast<std::streamsize>(text.size()));
+  }
+
+private:
+  std::ostream &os_;
+};
+#endif
+
+class FlagSet;
+class FlagSetStack;
+
+/* ParsePlan is the shape of an argument list resolved by FlagSet::Prepare:
+   which flag each entry names and which entries are values or positionals.
+   FlagSet::Execute checks a new argument list against the shape and then
+   converts the values without looking up names or classifying tokens. */
+class ParsePlan {
+public:
+  /* valid reports whether the sample argument list parsed without error. */
+  bool valid() const { return valid_; }
+
+private:
+  friend class FlagSet;
+  struct Step {
+    enum Kind : uint8_t {
+      kExact,      // the entry equals text
+      kBool,       // the entry equals text and sets a bool flag to true
+      kPrefix,     // the entry starts with text and carries the value
+      kValue,      // the value of the preceding flag entry
+      kPositional, // a positional argument
+    } kind;
+    bool after_end;  // kPositional: given after "--"
+    char short_name; // set when the flag was given as -f
+    Flag *flag;      // nullptr for "--", "-" and positionals
+    size_t arg;      // kPositional: index of the typed argument, or SIZE_MAX
+    std::string text;
+  };
+  const FlagSet *owner_ = nullptr;
+  int argc_ = 0;
+  bool valid_ = false;
+  std::vector<Step> steps_;
+
+  bool Matches(int argc, char **argv) const;
+};
+
+class FlagSet {
+public:
+  /* FlagSet creates a new, empty flag set with the specified name and
+   * description. */
+  explicit FlagSet(std::string name, std::string desc = {});
+  /* Int defines a int64_t flag with specified name, default value, and usage
+   * string. */
+  Flag *Int(std::string_view name, int64_t defaultVal, std::string_view usage,
+            char short_name = 0);
+  /* Float defines a double flag with specified name, default value, and usage
+   * string. */
+  Flag *Float(std::string_view name, double defaultVal, std::string_view usage,
+              char short_name = 0);
+  /* Int32 defines a int32_t flag with specified name, default value, and usage
+   * string. Values outside the int32_t range are rejected by Parse. */
+  Flag *Int32(std::string_view name, int32_t defaultVal, std::string_view usage,
+              char short_name = 0);
+  /* UInt32 defines a uint32_t flag with specified name, default value, and
+   * usage string. */
+  Flag *UInt32(std::string_view name, uint32_t defaultVal,
+               std::string_view usage, char short_name = 0);
+  /* UInt64 defines a uint64_t flag with specified name, default value, and
+   * usage string. */
+  Flag *UInt64(std::string_view name, uint64_t defaultVal,
+               std::string_view usage, char short_name = 0);
+  /* Float32 defines a float flag with specified name, default value, and
+   * usage string. Finite values outside the float range are rejected. */
+  Flag *Float32(std::string_view name, float defaultVal, std::string_view usage,
+                char short_name = 0);
+  /* Bool defines a bool flag with specified name, default value, and usage
+   * string. */
+  Flag *Bool(std::string_view name, bool defaultVal, std::string_view usage,
+             char short_name = 0);
+  /* String defines a string flag with specified name, default value, and usage
+   * string. */
+  Flag *String(std::string_view name, std::string_view defaultVal,
+               std::string_view usage, char short_name = 0);
+  /* StringSet defines a set-of-strings flag with specified name, default value
+   * (a comma-separated list), and usage string. Read it with
+   * As<StringSetValue>().contains(s). */
+  Flag *StringSet(std::string_view name, std::string_view defaultVal,
+                  std::string_view usage, char short_name = 0);
+  /* IpRangeList defines an IP range list flag with specified name, default
+   * value (comma-separated CIDR blocks), and usage string. Read it with
+   * As<IpRangeListValue>().contains(addr). An invalid default aborts. */
+  Flag *IpRangeList(std::string_view name, std::string_view defaultVal,
+                    std::string_view usage, char short_name = 0);
+  /* Json defines a JSON flag with specified name, default value (a JSON
+   * document), and usage string. Values are validated during Parse. Read it
+   * with As<JsonValue>().root(). An invalid default aborts. */
+  Flag *Json(std::string_view name, std::string_view defaultVal,
+             std::string_view usage, char short_name = 0);
+  /* Features defines a feature-toggle flag over the given feature names, with
+   * specified name, default value (a comma-separated list of enabled
+   * features), and usage string. The feature at position i is bit
+   * FeatureSet::Bit(i) of As<FeatureSet>().bits(). More than
+   * FeatureSet::kMaxFeatures names, or an unknown name in the default,
+   * aborts. */
+  Flag *Features(std::string_view name,
+                 std::initializer_list<std::string_view> features,
+                 std::string_view defaultVal, std::string_view usage,
+                 char short_name = 0);
+  /* Computed defines a read-only flag of type T whose value is fn(), where fn
+     reads the flags listed in inputs. inputs must be flags or computed flags
+     of this set defined earlier. The value is cached and recomputed only
+     after Parse, AdoptSnapshot or a Set of one of its inputs, so reading it
+     with As<T>() costs the same as reading any other flag. Computed flags
+     cannot be given on the command line; PrintUsage lists them after the
+     other flags. */
+  template <typename T, typename Fn>
+  const Flag *Computed(std::string_view name,
+                       std::initializer_list<const Flag *> inputs, Fn fn,
+                       std::string_view usage);
+
+  /* Parse parses flag definitions from the argument list, which should not
+     include the command name. It returns a ParseResult indicating success or
+     failure. */
+  ParseResult Parse(int argc, char **argv);
+  /* ParseParallel is Parse for very large argument lists. It splits argv into
+     chunks that are tokenized and converted on up to threads threads (0 means
+     one per core), and merges them so that values, positionals and the
+     returned error are exactly those of Parse. Short lists are parsed
+     sequentially. */
+  ParseResult ParseParallel(int argc, char **argv, unsigned threads = 0);
+  /* Reset restores every flag to its default and clears positionals, as if
+     nothing had been parsed. Its cost is proportional to the number of flags
+     set since the last reset. */
+  void Reset();
+  /* Prepare resolves the shape of a sample argument list into a plan for
+     Execute. The sample is not applied to any flag. */
+  ParsePlan Prepare(int argc, char **argv) const;
+  /* Execute parses an argument list with the shape of plan's sample: the
+     same argc and the same flags in the same order, with only values and
+     positionals changed. It falls back to Parse when the shape differs,
+     and the result is always that of Parse. */
+  ParseResult Execute(const ParsePlan &plan, int argc, char **argv);
+  /* Set updates the named flag at runtime as if it had been given on the
+     command line. It must not race with readers of the flag. */
+  ParseResult Set(std::string_view name, std::string_view value);
+  /* Lookup returns the Flag structure for a flag, or nullptr if not found. */
+  const Flag *Lookup(std::string_view name) const;
+  /* IsSet reports whether the flag was set by the user. */
+  bool IsSet(std::string_view name) const;
+  /* Generation changes whenever a flag is defined or flag values are
+     replaced, as Parse does, which ends the life of references returned by
+     Flag::As. Generations are unique across all flag sets. */
+  uint64_t Generation() const { return generation_; }
+  /* IsSet reports whether flag, which must be defined by this set, was set
+     by the user. It is a single bit test. */
+  bool IsSet(const Flag *flag) const {
+    assert(Owns(flag) && "flag is not defined by this set");
+    return (set_bits_[flag->id >> 6] >> (flag->id & 63)) & 1;
+  }
+  /* VisitSet calls fn(const Flag &) for each flag set by the user, in
+     definition order. It reads one word per 64 defined flags and touches
+     only the flags that are set. */
+  template <typename F> void VisitSet(F &&fn) const {
+    for (size_t w = 0; w < set_bits_.size(); ++w) {
+      for (uint64_t bits = set_bits_[w]; bits != 0; bits &= bits - 1) {
+        const Flag &flag = *flags_[w * 64 + detail::CountTrailingZeros(bits)];
+        fn(flag);
+      }
+    }
+  }
+
+  // Usage
+  /* PrintUsage prints a usage message to the given sink. */
+  void PrintUsage(Sink &out) const;
+  /* PrintError prints an error message to the given sink. */
+  void PrintError(const ParseResult &pr, Sink &out) const;
+#if !defined(CPPFLAG_NO_IOSTREAM)
+  /* PrintUsage prints a usage message to the given output stream. */
+  void PrintUsage(std::ostream &os) const;
+  /* PrintError prints an error message to the given output stream. */
+  void PrintError(const ParseResult &pr, std::ostream &os) const;
+#endif
+  /* Positional returns the non-flag arguments. */
+  std::vector<std::string> Positional() const {
+    return std::vector<std::string>(positional_.begin(), positional_.end());
+  }
+  /* PositionalViews returns the non-flag arguments as views into the argv
+     passed to Parse, without copying them. */
+  const std::vector<std::string_view> &PositionalViews() const {
+    return positional_;
+  }
+  /* Args declares typed positional arguments with a schema such as
+     "<src:string> <count:int> [files:string...]". Angle brackets mark a
+     required argument and square brackets an optional one; a trailing "..."
+     on the last argument makes it variadic. Types are int, int32, uint32,
+     uint64, float, float32, bool and string. Positionals are converted during
+     Parse, and a Parse fails if a required argument is missing or an
+     undeclared one is given. A malformed schema aborts the program with a
+     message on stderr, in every build type. */
+  void Args(std::string_view schema);
+  /* Arg returns the positional argument declared with the given name, or
+     nullptr if not found. Its value is available through Flag::As. */
+  const Flag *Arg(std::string_view name) const;
+  /* Rest returns the arguments matched by the variadic argument as views into
+     the argv passed to Parse. */
+  const std::vector<std::string_view> &Rest() const { return rest_; }
+  /* Snapshot returns the binary snapshot of the flags set by the user, or an
+     empty string with err set if a name, type name or value is too long for
+     its 32-bit length field. */
+  std::string Snapshot(std::string &err) const;
+  /* AdoptSnapshot resets all flags and then applies a snapshot written by
+     Snapshot, in place of a Parse. Every entry is validated against the
+     registered flags before anything is applied. */
+  ParseResult AdoptSnapshot(std::string_view data);
+#if defined(__linux__)
+  /* ExportMemfd writes the snapshot into a sealed memfd and returns its file
+     descriptor, or -1 with err set. The descriptor is inherited across exec,
+     so its number can be handed to a child process. */
+  int ExportMemfd(std::string &err) const;
+  /* AdoptMemfd maps a sealed memfd created by ExportMemfd and adopts the
+     snapshot it holds. It does not close fd. */
+  ParseResult AdoptMemfd(int fd);
+#endif
+  /* StrictUtf8 makes flag, a string, string-set or JSON flag or a string
+     positional argument of this set, reject values that are not valid
+     UTF-8. The check runs as the value is converted, so Parse, Set and
+     AdoptSnapshot fail with the byte offset of the first invalid byte in
+     the message. Any other kind of flag, or a default that is not valid
+     UTF-8, aborts. */
+  void StrictUtf8(const Flag *flag);
+  /* Validator checks the value of a flag after parsing. It returns false and
+     sets err if the value is unacceptable. */
+  using Validator = std::function<bool(const Flag &flag, std::string &err)>;
+  /* AddValidator attaches a check, such as a filesystem or network probe, to
+     flag. After a successful Parse all validators run in parallel on a small
+     pool of threads. Every failure is collected in ValidationErrors, and Parse
+     returns the first one in the order the validators were added.
+     Validators must not throw or modify flags. */
+  void AddValidator(const Flag *flag, Validator fn);
+  /* ValidationErrors returns the failures of the last Parse's validators. */
+  const std::vector<ParseResult> &ValidationErrors() const {
+    return validation_errors_;
+  }
+  /* ParseCacheStats counts the lookups of the parse cache. */
+  struct ParseCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    size_t entries = 0;
+  };
+  /* EnableParseCache puts a cache of up to capacity argument lists in front
+     of Parse. When an argument list equal to a cached one is parsed again,
+     the stored flag values and positionals are applied without tokenizing or
+     converting anything. Only successful parses are cached, and validators
+     still run on every Parse. A capacity of 0 disables the cache. */
+  void EnableParseCache(size_t capacity);
+  /* CacheStats returns the parse cache statistics. */
+  ParseCacheStats CacheStats() const;
+  /* SetRecorder makes every subsequent Parse append its input and outcome to
+     recorder. Pass nullptr to stop recording. */
+  void SetRecorder(ParseRecorder *recorder) { recorder_ = recorder; }
+
+private:
+  friend class FlagSetStack;
+  using NameIndex = std::unordered_map<std::string_view, Flag *>;
+  using ShortIndex = std::unordered_map<char, Flag *>;
+
+  std::string name_;
+  std::string desc_;
+  ParseRecorder *recorder_ = nullptr;
+  std::vector<std::unique_ptr<Flag>> flags_;
+  uint64_t generation_ = detail::NextGeneration();
+  NameIndex index_;
+  ShortIndex short_index_;
+  std::vector<uint64_t> set_bits_; // bit i mirrors flags_[i]->set
+  std::vector<std::string_view> positional_;
+  struct ArgSpec {
+    std::unique_ptr<Flag> flag;
+    bool required;
+    bool variadic;
+  };
+  std::string args_schema_;
+  std::vector<ArgSpec> args_;
+  std::vector<std::string_view> rest_;
+  struct ComputedSpec {
+    std::unique_ptr<Flag> flag;
+    std::function<void(Flag &)> update;
+    bool dirty;
+  };
+  // computed flags in definition order, which is also a dependency order
+  std::vector<ComputedSpec> computed_;
+  // dependency edges from each input flag to the computed flags reading it
+  std::unordered_map<const Flag *, std::vector<size_t>> dependents_;
+  struct ValidatorSpec {
+    const Flag *flag;
+    Validator fn;
+  };
+  std::vector<ValidatorSpec> validators_;
+  std::vector<ParseResult> validation_errors_;
+  // every flag whose set bit is clear holds its default value
+  bool unset_at_default_ = true;
+  /* CachedParse is the outcome of one successful Parse, stored as the values
+     of the flags it set. */
+  struct CachedParse {
+    uint64_t hash;
+    std::string key; // the argument list, each entry NUL-terminated
+    std::vector<std::pair<Flag *, std::unique_ptr<IValue>>> flags;
+    std::vector<uint64_t> set_bits; // the set bits of flags
+    std::vector<std::pair<Flag *, std::unique_ptr<IValue>>> args;
+    std::vector<int> positional; // argv indexes of the positionals
+    std::vector<int> rest;       // argv indexes of the variadic arguments
+  };
+  size_t cache_capacity_ = 0;
+  size_t cache_next_ = 0; // the entry replaced next once the cache is full
+  std::vector<CachedParse> cache_;
+  std::unordered_map<uint64_t, size_t> cache_index_;
+  ParseCacheStats cache_stats_;
+  template <typename T>
+  Flag *AddFlag(std::string_view name, char short_name, T defaultVal,
+                std::string_view usage);
+  /* Token is one argv entry classified by Scan, together with the value it
+     carries. */
+  struct Token {
+    enum Kind : uint8_t {
+      kPositional,
+      kFlag,
+      kEndOfFlags,
+      kIgnored,
+      kStop,
+    } kind;
+    char short_name; // set when the flag was given as -f
+    int index;       // argv index of the token
+    int next;        // argv index after the token and its value
+    Flag *flag;
+    std::string_view value;
+  };
+  static constexpr int kMinParallelArgs = 4096;
+  // validators mostly wait on I/O, so the pool is not limited to the cores
+  static constexpr size_t kMaxValidatorThreads = 8;
+
+  ParseResult ParseArgs(int argc, char **argv);
+  /* ParseTokens is the main loop of ParseArgs. Flags are resolved through the
+     given indexes, which may hold flags of other sets; positionals always
+     belong to this set. */
+  ParseResult ParseTokens(int argc, char **argv, const NameIndex &index,
+                          const ShortIndex &short_index);
+  ParseResult ParseArgsParallel(int argc, char **argv, unsigned threads);
+  static Token Scan(const NameIndex &index, const ShortIndex &short_index,
+                    int argc, char **argv, int i,
+                    const detail::TokenDesc &desc, bool no_more_flags,
+                    ParseResult &stop);
+  static bool IsBool(const Flag *flag);
+  static void Changed(Flag *flag) {
+    flag->version.fetch_add(1, std::memory_order_release);
+  }
+  void NewGeneration() { generation_ = detail::NextGeneration(); }
+  bool Owns(const Flag *flag) const {
+    return flag->id < flags_.size() && flags_[flag->id].get() == flag;
+  }
+  /* MarkSet sets flag->set and, if this set defines flag, its bit. */
+  void MarkSet(Flag *flag) {
+    flag->set = true;
+    if (Owns(flag)) {
+      // repeated updates leave the word, and the cache line that readers of
+      // neighbouring flags test, untouched
+      uint64_t &word = set_bits_[flag->id >> 6];
+      uint64_t bit = uint64_t(1) << (flag->id & 63);
+      if (!(word & bit)) {
+        word |= bit;
+      }
+    }
+  }
+  /* SyncSetBits rebuilds the bitset after flags were set through another
+     set's index, and marks the computed flags that depend on them dirty. */
+  void SyncSetBits();
+  /* Invalidate marks every computed flag that depends on flag, directly or
+     through other computed flags, as dirty. */
+  void Invalidate(const Flag *flag);
+  /* Recompute updates the dirty computed flags in dependency order. */
+  void Recompute();
+  /* Validate runs the validators and returns the first failure. */
+  ParseResult Validate();
+  /* ResetSetValues has the effect of ResetValues. When every unset flag
+     already holds its default, only the flags set since the last reset are
+     restored, except those in keep, which the caller overwrites next. */
+  void ResetSetValues(const std::vector<uint64_t> *keep);
+  /* ExecuteSteps converts the entries of an argument list that matches
+     plan. */
+  ParseResult ExecuteSteps(const ParsePlan &plan, char **argv);
+  static uint64_t HashArgs(int argc, char **argv);
+  /* ApplyCached replaces a Parse with the cached outcome for argv, if there
+     is one. */
+  bool ApplyCached(int argc, char **argv, uint64_t hash);
+  void StoreCached(int argc, char **argv, uint64_t hash);
+  void ClearCache();
+  // FlagError and ArgError fire the flag_invalid probe unless probe is
+  // false; ParseArgsParallel fires it itself, in argv order
+  // offset is the one SetWithOffset reported
+  static ParseResult FlagError(const Token &tok, const std::string &error,
+                               size_t offset, bool probe = true);
+  static ParseResult ArgError(const ArgSpec &spec, std::string_view value,
+                              const std::string &error, size_t offset,
+                              bool probe = true);
+  void ResetValues();
+  const ArgSpec *ArgFor(size_t ordinal, const char *arg,
+                        ParseResult &pr) const;
+  ParseResult CheckArgs() const;
+};
+
+/* FlagSetStack parses one argument list against an ordered stack of flag
+   sets, such as global, library and subcommand flags. The flags of all sets
+   are merged into a single index, so each token costs one lookup however many
+   sets are stacked. Positional arguments belong to the set pushed last. */
+class FlagSetStack {
+public:
+  /* Shadowing decides which set owns a name defined in more than one set.
+     The help flag every set defines is exempt. */
+  enum class Shadowing : uint8_t {
+    kInnerWins, // the set pushed later wins, e.g. subcommand over global
+    kOuterWins, // the set pushed earlier wins
+    kReject,    // defining a name twice aborts, in every build type
+  };
+
+  explicit FlagSetStack(Shadowing shadowing = Shadowing::kInnerWins)
+      : shadowing_(shadowing) {}
+
+  /* Push adds fs on top of the stack. fs must outlive the stack. */
+  void Push(FlagSet &fs);
+  /* Parse resets the flags of every set and then parses the argument list in
+     a single pass, as FlagSet::Parse does for one set. After a successful
+     parse the validators of every set run, and Parse returns the first
+     failure, bottom of the stack first. */
+  ParseResult Parse(int argc, char **argv);
+  /* ValidationErrors returns the failures of the last Parse's validators
+     across all sets, bottom of the stack first. */
+  const std::vector<ParseResult> &ValidationErrors() const {
+    return validation_errors_;
+  }
+  /* Lookup returns the flag that name resolves to, or nullptr if not found. */
+  const Flag *Lookup(std::string_view name) const;
+  /* PrintUsage prints the usage of every set, bottom of the stack first. */
+  void PrintUsage(Sink &out) const;
+#if !defined(CPPFLAG_NO_IOSTREAM)
+  void PrintUsage(std::ostream &os) const;
+#endif
+
+private:
+  Shadowing shadowing_;
+  std::vector<FlagSet *> sets_;
+  FlagSet::NameIndex index_;
+  FlagSet::ShortIndex short_index_;
+  size_t indexed_ = 0; // flag count of all sets when the index was built
+  std::vector<ParseResult> validation_errors_;
+
+  size_t FlagCount() const;
+  void Build();
+};
+
+/* FlagSetPool hands out fully defined FlagSets for short-lived use, such as
+   one command of a command server. Released sets are reset in place and kept
+   on a free list of the releasing thread, so acquiring one costs no
+   construction or flag definitions. Pooled sets must not be given new
+   flags, validators or a recorder after define has run. */
+class FlagSetPool {
+public:
+  /* FlagSetPool creates sets named name with description desc and calls
+     define on each new set, possibly from several threads at once. Each
+     thread keeps at most max_free released sets. */
+  FlagSetPool(std::string name, std::string desc,
+              std::function<void(FlagSet &)> define, size_t max_free = 16)
+      : name_(std::move(name)), desc_(std::move(desc)),
+        define_(std::move(define)), max_free_(max_free) {}
+
+  /* Release returns a set to the free list of the calling thread. */
+  struct Release {
+    uint64_t pool;
+    size_t max_free;
+    void operator()(FlagSet *fs) const;
+  };
+  using Lease = std::unique_ptr<FlagSet, Release>;
+
+  /* Acquire returns a reset set, reusing one released on this thread if
+     there is one. */
+  Lease Acquire();
+
+private:
+  using FreeList = std::vector<std::unique_ptr<FlagSet>>;
+  static FreeList &FreeListOf(uint64_t pool);
+  static uint64_t NextId() {
+    static std::atomic<uint64_t> next{0};
+    return next.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  uint64_t id_ = NextId();
+  std::string name_;
+  std::string desc_;
+  std::function<void(FlagSet &)> define_;
+  size_t max_free_;
+};
+
+namespace detail {
+
+inline void PutVarint(std::string &out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back(static_cast<char>((v & 0x7f) | 0x80));
+    v >>= 7;
+  }
+  out.push_back(static_cast<char>(v));
+}
+
+inline bool GetVarint(std::FILE *in, uint64_t &v) {
+  v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = std::fgetc(in);
+    if (c == EOF) {
+      return false;
+    }
+    v |= static_cast<uint64_t>(c & 0x7f) << shift;
+    if ((c & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+inline bool GetBytes(std::FILE *in, std::string &out) {
+  uint64_t len;
+  if (!GetVarint(in, len) || len > (uint64_t(1) << 32)) {
+    return false;
+  }
+  out.resize(len);
+  return len == 0 || std::fread(&out[0], 1, len, in) == len;
+}
+
+} // namespace detail
+
+ParseRecorder::ParseRecorder(std::FILE *out, bool record_outcome)
+    : out_(out), record_outcome_(record_outcome) {
+  if (std::fseek(out_, 0, SEEK_END) == 0 && std::ftell(out_) == 0) {
+    std::fwrite(kMagic, 1, sizeof(kMagic), out_);
+  }
+}
+
+void ParseRecorder::Record(int argc, char **argv, const ParseResult *pr,
+                           std::string_view values) {
+  // build the whole record first so that it reaches the log in one write
+  buf_.clear();
+  detail::PutVarint(buf_, static_cast<uint64_t>(argc));
+  for (int i = 0; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    detail::PutVarint(buf_, arg.size());
+    buf_.append(arg);
+  }
+  if (!record_outcome_ || pr == nullptr) {
+    buf_.push_back(static_cast<char>(kNoOutcome));
+  } else {
+    buf_.push_back(static_cast<char>(pr->kind));
+    std::string_view tail = pr->ok() ? values : std::string_view(pr->flag);
+    detail::PutVarint(buf_, tail.size());
+    buf_.append(tail);
+  }
+  std::fwrite(buf_.data(), 1, buf_.size(), out_);
+  std::fflush(out_);
+}
+
+bool ReadParseLog(std::FILE *in, std::vector<ParseRecord> &records,
+                  std::string &err) {
+  char magic[sizeof(ParseRecorder::kMagic)];
+  if (std::fread(magic, 1, sizeof(magic), in) != sizeof(magic) ||
+      std::string_view(magic, sizeof(magic)) !=
+          std::string_view(ParseRecorder::kMagic, sizeof(magic))) {
+    err = "not a parse log";
+    return false;
+  }
+  for (int c; (c = std::fgetc(in)) != EOF;) {
+    std::ungetc(c, in);
+    uint64_t argc;
+    if (!detail::GetVarint(in, argc)) {
+      err = "truncated record";
+      return false;
+    }
+    ParseRecord rec;
+    rec.args.resize(argc);
+    for (auto &arg : rec.args) {
+      if (!detail::GetBytes(in, arg)) {
+        err = "truncated record";
+        return false;
+      }
+    }
+    int outcome = std::fgetc(in);
+    if (outcome == EOF) {
+      err = "truncated record";
+      return false;
+    }
+    if (outcome != ParseRecorder::kNoOutcome) {
+      if (outcome > static_cast<int>(ParseErrorKind::ValidationFailed)) {
+        err = "invalid outcome in record";
+        return false;
+      }
+      rec.has_outcome = true;
+      rec.kind = static_cast<ParseErrorKind>(outcome);
+      if (!detail::GetBytes(in, rec.kind == ParseErrorKind::None ? rec.values
+                                                                  : rec.flag)) {
+        err = "truncated record";
+        return false;
+      }
+    }
+    records.push_back(std::move(rec));
+  }
+  return true;
+}
+
+FlagSet::FlagSet(std::string name, std::string desc) {
+  name_ = name;
+  desc_ = desc;
+  Bool("help", false, "show this help message", 'h');
+}
+
+template <typename T>
+Flag *FlagSet::AddFlag(std::string_view name, char short_name, T defaultVal,
+                       std::string_view usage) {
+  auto ptr = std::make_unique<Flag>();
+  ptr->name = name;
+  ptr->usage = usage;
+  ptr->short_name = short_name;
+  auto v_ptr = std::make_unique<ValueAdapter<T>>(std::move(defaultVal));
+  ptr->default_value = std::unique_ptr<IValue>(v_ptr->clone());
+  ptr->value = std::move(v_ptr);
+  ptr->set = false;
+  ptr->id = static_cast<uint32_t>(this->flags_.size());
+  if (ptr->id % 64 == 0) {
+    this->set_bits_.push_back(0);
+  }
+  this->flags_.emplace_back(std::move(ptr));
+  NewGeneration();
+  ClearCache();
+  Flag *flag_ptr = this->flags_.back().get();
+  this->index_[name] = flag_ptr;
+  if (short_name != 0) {
+    this->short_index_[short_name] = flag_ptr;
+  }
+  return flag_ptr;
+}
+
+template <typename T, typename Fn>
+const Flag *FlagSet::Computed(std::string_view name,
+                              std::initializer_list<const Flag *> inputs,
+                              Fn fn, std::string_view usage) {
+  assert(!Lookup(name) && "flag redefined");
+  ComputedSpec spec;
+  spec.flag = std::make_unique<Flag>();
+  spec.flag->name = name;
+  spec.flag->usage = usage;
+  spec.flag->computed = true;
+  spec.update = [fn = std::move(fn)](Flag &flag) {
+    flag.value = std::make_unique<ValueAdapter<T>>(fn());
+  };
+  spec.update(*spec.flag);
+  spec.flag->default_value.reset(spec.flag->value->clone());
+  spec.dirty = false;
+  size_t index = computed_.size();
+  for (const Flag *input : inputs) {
+    assert(Lookup(input->name) == input && "input is not a flag of this set");
+    dependents_[input].push_back(index);
+  }
+  computed_.push_back(std::move(spec));
+  Flag *flag = computed_.back().flag.get();
+  index_[flag->name] = flag;
+  NewGeneration();
+  return flag;
+}
+
+Flag *FlagSet::Int(std::string_view name, int64_t defaultVal,
+                   std::string_view usage, char short_name) {
+  return AddFlag<int64_t>(name, short_name, defaultVal, usage);
+}
+
+Flag *FlagSet::Float(std::string_view name, double defaultVal,
+                     std::string_view usage, char short_name) {
+  return AddFlag<double>(name, short_name, defaultVal, usage);
+}
+
+Flag *FlagSet::Int32(std::string_view name, int32_t defaultVal,
+                     std::string_view usage, char short_name) {
+  return AddFlag<int32_t>(name, short_name, defaultVal, usage);
+}
+
+Flag *FlagSet::UInt32(std::string_view name, uint32_t defaultVal,
+                      std::string_view usage, char short_name) {
+  return AddFlag<uint32_t>(name, short_name, defaultVal, usage);
+}
+
+Flag *FlagSet::UInt64(std::string_view name, uint64_t defaultVal,
+                      std::string_view usage, char short_name) {
+  return AddFlag<uint64_t>(name, short_name, defaultVal, usage);
+}
+
+Flag *FlagSet::Float32(std::string_view name, float defaultVal,
+                       std::string_view usage, char short_name) {
+  return AddFlag<float>(name, short_name, defaultVal, usage);
+}
+
+Flag *FlagSet::Bool(std::string_view name, bool defaultVal,
+                    std::string_view usage, char short_name) {
+  return AddFlag<bool>(name, short_name, defaultVal, usage);
+}
+
+Flag *FlagSet::String(std::string_view name, std::string_view defaultVal,
+                      std::string_view usage, char short_name) {
+  return AddFlag<std::string>(name, short_name, std::string(defaultVal), usage);
+}
+
+Flag *FlagSet::StringSet(std::string_view name, std::string_view defaultVal,
+                         std::string_view usage, char short_name) {
+  StringSetValue set;
+  std::string err;
+  set.Parse(defaultVal, err);
+  return AddFlag<StringSetValue>(name, short_name, std::move(set), usage);
+}
+
+Flag *FlagSet::IpRangeList(std::string_view name, std::string_view defaultVal,
+                           std::string_view usage, char short_name) {
+  IpRangeListValue list;
+  std::string err;
+  if (!list.Parse(defaultVal, err)) {
+    detail::DefinitionError(name, "invalid default: " + err);
+  }
+  return AddFlag<IpRangeListValue>(name, short_name, std::move(list), usage);
+}
+
+Flag *FlagSet::Json(std::string_view name, std::string_view defaultVal,
+                    std::string_view usage, char short_name) {
+  JsonValue doc;
+  std::string err;
+  if (!doc.Parse(defaultVal, err)) {
+    detail::DefinitionError(name, "invalid default: " + err);
+  }
+  return AddFlag<JsonValue>(name, short_name, std::move(doc), usage);
+}
+
+Flag *FlagSet::Features(std::string_view name,
+                        std::initializer_list<std::string_view> features,
+                        std::string_view defaultVal, std::string_view usage,
+                        char short_name) {
+  FeatureSet set(features);
+  std::string err;
+  if (!set.Parse(defaultVal, err)) {
+    detail::DefinitionError(name, "invalid default: " + err);
+  }
+  return AddFlag<FeatureSet>(name, short_name, std::move(set), usage);
+}
+
+/* Parse parses flag definitions from the argument list, which should not
+   include the command name. It returns a ParseResult indicating success or
+   failure. */
+ParseResult FlagSet::Parse(int argc, char **argv) {
+  CPPFLAG_PROBE2(parse_start, argc, argv);
+  ParseResult pr;
+  uint64_t hash = cache_capacity_ != 0 ? HashArgs(argc, argv) : 0;
+  if (cache_capacity_ != 0 && ApplyCached(argc, argv, hash)) {
+    pr = Validate();
+  } else {
+    pr = ParseArgs(argc, argv);
+    unset_at_default_ = pr.ok();
+    Recompute();
+    if (pr) {
+      if (cache_capacity_ != 0) {
+        StoreCached(argc, argv, hash);
+      }
+      pr = Validate();
+    }
+  }
+  CPPFLAG_PROBE2(parse_done, static_cast<int>(pr.kind), pr.flag.c_str());
+  if (recorder_) {
+    std::string err;
+    recorder_->Record(argc, argv, &pr, pr ? Snapshot(err) : std::string());
+  }
+  return pr;
+}
+
+ParseResult FlagSet::ParseArgs(int argc, char **argv) {
+  ResetSetValues(nullptr);
+  return ParseTokens(argc, argv, index_, short_index_);
+}
+
+ParseResult FlagSet::ParseTokens(int argc, char **argv, const NameIndex &index,
+                                 const ShortIndex &short_index) {
+  bool no_more_flags = false;
+  detail::TokenCursor cursor(argv, argc);
+  for (int i = 1; i < argc;) {
+    ParseResult stop;
+    Token tok = Scan(index, short_index, argc, argv, i, cursor.At(i),
+                     no_more_flags, stop);
+    i = tok.next;
+    switch (tok.kind) {
+    case Token::kStop:
+      return stop;
+    case Token::kEndOfFlags:
+      no_more_flags = true;
+      break;
+    case Token::kPositional: {
+      positional_.emplace_back(argv[tok.index]);
+      const ArgSpec *spec = ArgFor(positional_.size() - 1, argv[tok.index], stop);
+      if (!stop) {
+        return stop;
+      }
+      if (spec) {
+        std::string error;
+        size_t offset;
+        if (!spec->flag->value->SetWithOffset(tok.value, error, offset)) {
+          return ArgError(*spec, tok.value, error, offset);
+        }
+        spec->flag->set = true;
+        Changed(spec->flag.get());
+        if (spec->variadic) {
+          rest_.push_back(tok.value);
+        }
+      }
+      break;
+    }
+    case Token::kFlag: {
+      std::string error;
+      size_t offset;
+      if (!tok.flag->value->SetWithOffset(tok.value, error, offset)) {
+        return FlagError(tok, error, offset);
+      }
+      MarkSet(tok.flag);
+      Changed(tok.flag);
+      Invalidate(tok.flag);
+      CPPFLAG_PROBE3(flag_set, tok.flag->name.c_str(), tok.value.data(),
+                     tok.value.size());
+      break;
+    }
+    case Token::kIgnored:
+      break;
+    }
+  }
+
+  return CheckArgs();
+}
+
+FlagSet::Token FlagSet::Scan(const NameIndex &index,
+                             const ShortIndex &short_index, int argc,
+                             char **argv, int i, const detail::TokenDesc &desc,
+                             bool no_more_flags, ParseResult &stop) {
+  Token tok{Token::kIgnored, 0, i, i + 1, nullptr, {}};
+  std::string_view arg(argv[i], desc.len);
+
+  if (desc.dashes != 0 && desc.len <= 6 &&
+      (arg == "--help" || arg == "-h" || arg == "-help")) {
+    tok.kind = Token::kStop;
+    stop = {ParseErrorKind::HelpRequested, "", ""};
+    return tok;
+  }
+
+  if (no_more_flags) {
+    tok.kind = Token::kPositional;
+    tok.value = arg;
+    return tok;
+  }
+
+  if (desc.dashes == 2 && desc.len == 2) {
+    tok.kind = Token::kEndOfFlags;
+    return tok;
+  }
+
+  // handle positional arguments
+  if (desc.dashes == 0) {
+    tok.kind = Token::kPositional;
+    tok.value = arg;
+    return tok;
+  }
+
+  // handle long options --flag=value or --flag value
+  if (desc.dashes == 2) {
+    std::string_view flag_name;
+    bool has_value = desc.eq != desc.len;
+    if (has_value) {
+      // --flag=value format
+      flag_name = arg.substr(2, desc.eq - 2);
+      tok.value = arg.substr(desc.eq + 1);
+    } else {
+      // --flag value format
+      flag_name = arg.substr(2);
+    }
+
+    auto it = index.find(flag_name);
+    if (it == index.end() || it->second->computed) {
+      tok.kind = Token::kStop;
+      stop = ParseResult{ParseErrorKind::UnknownFlag, std::string(flag_name),
+                         "unknown flag: " + std::string(flag_name)};
+      return tok;
+    }
+    tok.flag = it->second;
+
+    if (!has_value) {
+      if (IsBool(tok.flag)) {
+        tok.value = "true";
+      } else if (i + 1 < argc && argv[i + 1][0] != '-') {
+        tok.value = argv[i + 1];
+        tok.next = i + 2;
+      } else {
+        tok.kind = Token::kStop;
+        stop = ParseResult{ParseErrorKind::MissingValue, tok.flag->name,
+                           "flag '" + tok.flag->name + "' needs a value"};
+        return tok;
+      }
+    }
+    tok.kind = Token::kFlag;
+    return tok;
+  }
+
+  // handle short options -f value or -fvalue
+  if (desc.len > 1) {
+    char flag_char = arg[1];
+    tok.short_name = flag_char;
+    auto it = short_index.find(flag_char);
+    if (it == short_index.end()) {
+      tok.kind = Token::kStop;
+      stop = ParseResult{ParseErrorKind::UnknownFlag, std::string(1, flag_char),
+                         "unknown flag: -" + std::string(1, flag_char)};
+      return tok;
+    }
+    tok.flag = it->second;
+
+    if (arg.size() > 2) {
+      // -fvalue format
+      tok.value = arg.substr(2);
+    } else if (IsBool(tok.flag)) {
+      // -f format, value might be next arg, or implicit for bool
+      tok.value = "true";
+    } else if (i + 1 < argc) {
+      tok.value = argv[i + 1];
+      tok.next = i + 2;
+    } else {
+      tok.kind = Token::kStop;
+      stop = ParseResult{ParseErrorKind::MissingValue, tok.flag->name,
+                         "flag '-" + std::string(1, flag_char) +
+                             "' needs a value"};
+      return tok;
+    }
+    tok.kind = Token::kFlag;
+  }
+  return tok;
+}
+
+bool FlagSet::IsBool(const Flag *flag) {
+  return dynamic_cast<const ValueAdapter<bool> *>(flag->value.get()) !=
+         nullptr;
+}
+
+ParseResult FlagSet::FlagError(const Token &tok, const std::string &error,
+                               size_t offset, bool probe) {
+  if (probe) {
+    CPPFLAG_PROBE3(flag_invalid, tok.flag->name.c_str(), tok.value.data(),
+                   tok.value.size());
+  }
+  std::string shown = tok.short_name ? "-" + std::string(1, tok.short_name)
+                                     : tok.flag->name;
+  ParseResult pr{ParseErrorKind::InvalidValue, tok.flag->name,
+                 "invalid value for flag '" + shown + "': " + error};
+  pr.offset = offset;
+  return pr;
+}
+
+ParseResult FlagSet::ArgError(const ArgSpec &spec, std::string_view value,
+                              const std::string &error, size_t offset,
+                              bool probe) {
+  if (probe) {
+    CPPFLAG_PROBE3(flag_invalid, spec.flag->name.c_str(), value.data(),
+                   value.size());
+  }
+  ParseResult pr{ParseErrorKind::InvalidValue, spec.flag->name,
+                 "invalid value for argument '" + spec.flag->name +
+                     "': " + error};
+  pr.offset = offset;
+  (void)value;
+  return pr;
+}
+
+void FlagSet::ResetValues() {
+  NewGeneration();
+  positional_.clear();
+  rest_.clear();
+  validation_errors_.clear();
+  std::fill(set_bits_.begin(), set_bits_.end(), 0);
+  // an unset flag only differs from its default after a failed conversion,
+  // so the version, which readers' compiled and cached entries key on, is
+  // bumped only for flags whose value actually changes
+  std::string current, initial;
+  auto at_default = [&](const Flag &flag) {
+    if (flag.set) {
+      return false;
+    }
+    if (unset_at_default_) {
+      return true;
+    }
+    current.clear();
+    initial.clear();
+    flag.value->Encode(current);
+    flag.default_value->Encode(initial);
+    return current == initial;
+  };
+  for (const auto &flag : flags_) {
+    if (!at_default(*flag)) {
+      flag->value.reset(flag->default_value->clone());
+      flag->set = false;
+      Changed(flag.get());
+      Invalidate(flag.get());
+    }
+  }
+  for (const auto &spec : args_) {
+    if (!at_default(*spec.flag)) {
+      spec.flag->value.reset(spec.flag->default_value->clone());
+      spec.flag->set = false;
+      Changed(spec.flag.get());
+    }
+  }
+  unset_at_default_ = true;
+}
+
+const FlagSet::ArgSpec *FlagSet::ArgFor(size_t ordinal, const char *arg,
+                                        ParseResult &pr) const {
+  if (args_.empty()) {
+    return nullptr;
+  }
+  if (ordinal < args_.size()) {
+    return &args_[ordinal];
+  }
+  if (args_.back().variadic) {
+    return &args_.back();
+  }
+  pr = ParseResult{ParseErrorKind::UnexpectedArgument, arg,
+                   "unexpected argument: " + std::string(arg)};
+  return nullptr;
+}
+
+ParseResult FlagSet::ParseParallel(int argc, char **argv, unsigned threads) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  if (threads == 1 || argc < kMinParallelArgs) {
+    return Parse(argc, argv);
+  }
+  CPPFLAG_PROBE2(parse_start, argc, argv);
+  ParseResult pr = ParseArgsParallel(argc, argv, threads);
+  unset_at_default_ = pr.ok();
+  Recompute();
+  if (pr) {
+    pr = Validate();
+  }
+  CPPFLAG_PROBE2(parse_done, static_cast<int>(pr.kind), pr.flag.c_str());
+  if (recorder_) {
+    std::string err;
+    recorder_->Record(argc, argv, &pr, pr ? Snapshot(err) : std::string());
+  }
+  return pr;
+}
+
+/* ParseArgsParallel produces exactly the state and result of ParseArgs.
+   argv is split where the previous token can never consume the next one as
+   its value. Each chunk is first tokenized on its own; a "--" found in one
+   chunk makes the later chunks rescan in positional mode. Once positional
+   ordinals are known from the per-chunk counts, chunks convert their values
+   into private copies, stopping at their first error. The merge then applies
+   the chunks in order up to the first one that stopped. */
+ParseResult FlagSet::ParseArgsParallel(int argc, char **argv,
+                                       unsigned threads) {
+  struct Chunk {
+    int begin;
+    int end;
+    bool no_more_flags = false;
+    bool saw_end_of_flags = false;
+    bool stopped = false;
+    bool stopped_in_rest = false;
+    ParseResult stop;
+    std::vector<Token> tokens;
+    size_t applied = 0; // tokens converted before a stop
+    const Flag *invalid = nullptr; // the flag whose conversion stopped it
+    std::string_view invalid_value;
+    size_t positional_base = 0;
+    size_t positional_count = 0;
+    std::unordered_map<Flag *, std::unique_ptr<IValue>> values;
+  };
+
+  ResetValues();
+
+  // a boundary is safe if the token before it never takes a separate value
+  auto safe_boundary = [&](int b) {
+    std::string_view prev = argv[b - 1];
+    if (prev.empty() || prev[0] != '-') {
+      return true;
+    }
+    if (prev.size() > 2 && prev[1] == '-') {
+      return prev.find('=') != std::string_view::npos;
+    }
+    return prev.size() > 2;
+  };
+  std::vector<Chunk> chunks;
+  int begin = 1;
+  for (unsigned c = 1; c <= threads && begin < argc; ++c) {
+    int end = c == threads ? argc
+                           : std::max(begin + 1, static_cast<int>(
+                                                     1 + int64_t(argc - 1) *
+                                                             c / threads));
+    while (end < argc && !safe_boundary(end)) {
+      ++end;
+    }
+    chunks.emplace_back();
+    chunks.back().begin = begin;
+    chunks.back().end = end;
+    begin = end;
+  }
+
+  auto run = [&](size_t first, auto fn) {
+    std::vector<std::thread> workers;
+    for (size_t c = first + 1; c < chunks.size(); ++c) {
+      workers.emplace_back(fn, std::ref(chunks[c]));
+    }
+    if (first < chunks.size()) {
+      fn(chunks[first]);
+    }
+    for (auto &w : workers) {
+      w.join();
+    }
+  };
+  auto tokenize = [&](Chunk &ch) {
+    ch.tokens.clear();
+    ch.stopped = false;
+    ch.saw_end_of_flags = false;
+    bool no_more_flags = ch.no_more_flags;
+    detail::TokenCursor cursor(argv, ch.end);
+    for (int i = ch.begin; i < ch.end;) {
+      Token tok = Scan(index_, short_index_, argc, argv, i, cursor.At(i),
+                       no_more_flags, ch.stop);
+      i = tok.next;
+      if (tok.kind == Token::kStop) {
+        ch.stopped = true;
+        return;
+      }
+      if (tok.kind == Token::kEndOfFlags) {
+        no_more_flags = true;
+        ch.saw_end_of_flags = true;
+      } else if (tok.kind != Token::kIgnored) {
+        ch.tokens.push_back(tok);
+      }
+    }
+  };
+
+  run(0, tokenize);
+  size_t last = chunks.size() - 1;
+  for (size_t c = 0; c < chunks.size(); ++c) {
+    if (chunks[c].stopped) {
+      last = c;
+      break;
+    }
+    if (chunks[c].saw_end_of_flags) {
+      for (size_t r = c + 1; r < chunks.size(); ++r) {
+        chunks[r].no_more_flags = true;
+      }
+      run(c + 1, tokenize);
+    }
+  }
+  chunks.resize(last + 1);
+
+  size_t total = 0;
+  for (auto &ch : chunks) {
+    ch.positional_base = total;
+    for (const auto &tok : ch.tokens) {
+      total += tok.kind == Token::kPositional;
+    }
+  }
+  positional_.resize(total);
+  size_t rest_base = args_.empty() ? 0 : args_.size() - 1;
+  if (!args_.empty() && args_.back().variadic && total > rest_base) {
+    rest_.resize(total - rest_base);
+  }
+
+  run(0, [&](Chunk &ch) {
+    std::string error;
+    size_t offset;
+    auto set = [&](Flag *flag, std::string_view text) {
+      auto &slot = ch.values[flag];
+      if (!slot) {
+        slot.reset(flag->default_value->clone());
+        if (!slot->SetWithOffset(text, error, offset)) {
+          ch.values.erase(flag);
+          return false;
+        }
+        return true;
+      }
+      return slot->SetWithOffset(text, error, offset);
+    };
+    for (ch.applied = 0; ch.applied < ch.tokens.size(); ++ch.applied) {
+      const Token &tok = ch.tokens[ch.applied];
+      if (tok.kind == Token::kFlag) {
+        if (!set(tok.flag, tok.value)) {
+          ch.stopped = true;
+          ch.stop = FlagError(tok, error, offset, false);
+          ch.invalid = tok.flag;
+          ch.invalid_value = tok.value;
+          return;
+        }
+        continue;
+      }
+      size_t ordinal = ch.positional_base + ch.positional_count++;
+      positional_[ordinal] = tok.value;
+      ParseResult pr;
+      const ArgSpec *spec = ArgFor(ordinal, argv[tok.index], pr);
+      if (!pr) {
+        ch.stopped = true;
+        ch.stop = std::move(pr);
+        return;
+      }
+      if (spec) {
+        if (!set(spec->flag.get(), tok.value)) {
+          ch.stopped = true;
+          ch.stopped_in_rest = spec->variadic;
+          ch.stop = ArgError(*spec, tok.value, error, offset, false);
+          ch.invalid = spec->flag.get();
+          ch.invalid_value = tok.value;
+          return;
+        }
+        if (spec->variadic) {
+          rest_[ordinal - rest_base] = tok.value;
+        }
+      }
+    }
+  });
+
+  NewGeneration();
+  for (auto &ch : chunks) {
+    for (auto &[flag, value] : ch.values) {
+      flag->value = std::move(value);
+      MarkSet(flag);
+      Changed(flag);
+      Invalidate(flag);
+    }
+    // one event per occurrence with its text, as the sequential parse fires
+    for (size_t k = 0; k < ch.applied; ++k) {
+      const Token &tok = ch.tokens[k];
+      if (tok.kind == Token::kFlag) {
+        CPPFLAG_PROBE3(flag_set, tok.flag->name.c_str(), tok.value.data(),
+                       tok.value.size());
+      }
+    }
+    if (ch.stopped && ch.invalid) {
+      CPPFLAG_PROBE3(flag_invalid, ch.invalid->name.c_str(),
+                     ch.invalid_value.data(), ch.invalid_value.size());
+    }
+    if (ch.stopped) {
+      size_t count = ch.positional_base + ch.positional_count;
+      positional_.resize(count);
+      size_t rest_count = count - ch.stopped_in_rest;
+      rest_.resize(rest_count > rest_base
+                       ? std::min(rest_.size(), rest_count - rest_base)
+                       : 0);
+      return ch.stop;
+    }
+  }
+  return CheckArgs();
+}
+
+namespace detail {
+
+inline bool IsHelpArg(const char *arg) {
+  return std::strcmp(arg, "--help") == 0 || std::strcmp(arg, "-h") == 0 ||
+         std::strcmp(arg, "-help") == 0;
+}
+
+} // namespace detail
+
+bool ParsePlan::Matches(int argc, char **argv) const {
+  if (argc != argc_) {
+    return false;
+  }
+  for (size_t k = 0; k < steps_.size(); ++k) {
+    const Step &step = steps_[k];
+    const char *arg = argv[k + 1];
+    switch (step.kind) {
+    case Step::kExact:
+    case Step::kBool:
+      if (std::memcmp(arg, step.text.c_str(), step.text.size() + 1) != 0) {
+        return false;
+      }
+      break;
+    case Step::kPrefix:
+      // -f needs a value after the prefix; --flag= may have an empty one
+      if (std::strncmp(arg, step.text.data(), step.text.size()) != 0 ||
+          (step.short_name && arg[step.text.size()] == '\0') ||
+          detail::IsHelpArg(arg)) {
+        return false;
+      }
+      break;
+    case Step::kValue:
+      if (!step.short_name && arg[0] == '-') {
+        return false;
+      }
+      break;
+    case Step::kPositional:
+      if (step.after_end ? detail::IsHelpArg(arg) : arg[0] == '-') {
+        return false;
+      }
+      break;
+    }
+  }
+  return true;
+}
+
+ParsePlan FlagSet::Prepare(int argc, char **argv) const {
+  ParsePlan plan;
+  plan.owner_ = this;
+  plan.argc_ = argc;
+  bool no_more_flags = false;
+  size_t positionals = 0;
+  detail::TokenCursor cursor(argv, argc);
+  for (int i = 1; i < argc;) {
+    ParseResult stop;
+    Token tok = Scan(index_, short_index_, argc, argv, i, cursor.At(i),
+                     no_more_flags, stop);
+    i = tok.next;
+    std::string_view arg = argv[tok.index];
+    ParsePlan::Step step{ParsePlan::Step::kExact, no_more_flags,
+                         tok.short_name, tok.flag, SIZE_MAX, {}};
+    switch (tok.kind) {
+    case Token::kStop:
+      return plan;
+    case Token::kEndOfFlags:
+      no_more_flags = true;
+      step.text = arg;
+      break;
+    case Token::kIgnored:
+      step.text = arg;
+      break;
+    case Token::kPositional: {
+      const ArgSpec *spec = ArgFor(positionals++, argv[tok.index], stop);
+      if (!stop) {
+        return plan;
+      }
+      step.kind = ParsePlan::Step::kPositional;
+      step.arg = spec ? static_cast<size_t>(spec - args_.data()) : SIZE_MAX;
+      break;
+    }
+    case Token::kFlag:
+      if (tok.next == tok.index + 2) {
+        step.text = arg;
+        plan.steps_.push_back(step);
+        step.kind = ParsePlan::Step::kValue;
+        step.text.clear();
+      } else if (tok.value.data() >= arg.data() &&
+                 tok.value.data() <= arg.data() + arg.size()) {
+        step.kind = ParsePlan::Step::kPrefix;
+        step.text = arg.substr(0, tok.value.data() - arg.data());
+      } else {
+        step.kind = ParsePlan::Step::kBool;
+        step.text = arg;
+      }
+      break;
+    }
+    plan.steps_.push_back(std::move(step));
+  }
+  plan.valid_ = true;
+  return plan;
+}
+
+ParseResult FlagSet::Execute(const ParsePlan &plan, int argc, char **argv) {
+  assert(plan.owner_ == this && "plan prepared by another FlagSet");
+  if (!plan.valid_ || !plan.Matches(argc, argv)) {
+    return Parse(argc, argv);
+  }
+  CPPFLAG_PROBE2(parse_start, argc, argv);
+  ResetSetValues(nullptr);
+  ParseResult pr = ExecuteSteps(plan, argv);
+  unset_at_default_ = pr.ok();
+  Recompute();
+  if (pr) {
+    pr = Validate();
+  }
+  CPPFLAG_PROBE2(parse_done, static_cast<int>(pr.kind), pr.flag.c_str());
+  if (recorder_) {
+    std::string err;
+    recorder_->Record(argc, argv, &pr, pr ? Snapshot(err) : std::string());
+  }
+  return pr;
+}
+
+ParseResult FlagSet::ExecuteSteps(const ParsePlan &plan, char **argv) {
+  std::string error;
+  size_t offset;
+  for (size_t k = 0; k < plan.steps_.size(); ++k) {
+    const ParsePlan::Step &step = plan.steps_[k];
+    const char *arg = argv[k + 1];
+    std::string_view value;
+    switch (step.kind) {
+    case ParsePlan::Step::kExact:
+      // "--", "-", or a flag whose value is the next step
+      continue;
+    case ParsePlan::Step::kBool:
+      value = "true";
+      break;
+    case ParsePlan::Step::kPrefix:
+      value = arg + step.text.size();
+      break;
+    case ParsePlan::Step::kValue:
+      value = arg;
+      break;
+    case ParsePlan::Step::kPositional: {
+      positional_.emplace_back(arg);
+      if (step.arg == SIZE_MAX) {
+        continue;
+      }
+      const ArgSpec &spec = args_[step.arg];
+      value = arg;
+      if (!spec.flag->value->SetWithOffset(value, error, offset)) {
+        return ArgError(spec, value, error, offset);
+      }
+      spec.flag->set = true;
+      Changed(spec.flag.get());
+      if (spec.variadic) {
+        rest_.push_back(value);
+      }
+      continue;
+    }
+    }
+    if (!step.flag->value->SetWithOffset(value, error, offset)) {
+      Token tok{Token::kFlag, step.short_name, static_cast<int>(k + 1),
+                static_cast<int>(k + 2), step.flag, value};
+      return FlagError(tok, error, offset);
+    }
+    MarkSet(step.flag);
+    Changed(step.flag);
+    Invalidate(step.flag);
+    CPPFLAG_PROBE3(flag_set, step.flag->name.c_str(), value.data(),
+                   value.size());
+  }
+  return CheckArgs();
+}
+
+ParseResult FlagSet::CheckArgs() const {
+  for (size_t i = positional_.size(); i < args_.size(); ++i) {
+    if (args_[i].required) {
+      const std::string &name = args_[i].flag->name;
+      return ParseResult{ParseErrorKind::MissingArgument, name,
+                         "missing argument: " + name};
+    }
+  }
+  return ParseResult{};
+}
+
+void FlagSet::Args(std::string_view schema) {
+  ClearCache();
+  args_schema_ = schema;
+  args_.clear();
+  // a bad schema is a programming error, but one that must not slip
+  // through release builds as a hang or a wrongly typed argument
+  auto bad = [&](const char *what) {
+    std::fprintf(stderr, "cppflag: invalid Args schema \"%.*s\": %s\n",
+                 static_cast<int>(schema.size()), schema.data(), what);
+    std::abort();
+  };
+  size_t pos = 0;
+  while (true) {
+    pos = schema.find_first_not_of(' ', pos);
+    if (pos == std::string_view::npos) {
+      break;
+    }
+    char open = schema[pos];
+    char close = open == '<' ? '>' : ']';
+    if (open != '<' && open != '[') {
+      bad("argument must start with < or [");
+    }
+    size_t end = schema.find(close, pos);
+    if (end == std::string_view::npos) {
+      bad("unterminated argument");
+    }
+    std::string_view item = schema.substr(pos + 1, end - pos - 1);
+    pos = end + 1;
+
+    ArgSpec spec;
+    spec.required = open == '<';
+    spec.variadic = item.size() > 3 && item.substr(item.size() - 3) == "...";
+    if (spec.variadic) {
+      item.remove_suffix(3);
+    }
+    if (!args_.empty() && args_.back().variadic) {
+      bad("only the last argument may be variadic");
+    }
+    if (spec.required && !args_.empty() && !args_.back().required) {
+      bad("required argument after an optional one");
+    }
+    size_t colon = item.find(':');
+    std::string_view type =
+        colon == std::string_view::npos ? "string" : item.substr(colon + 1);
+    spec.flag = std::make_unique<Flag>();
+    spec.flag->name = item.substr(0, colon);
+    if (type == "int") {
+      spec.flag->value = std::make_unique<ValueAdapter<int64_t>>(0);
+    } else if (type == "int32") {
+      spec.flag->value = std::make_unique<ValueAdapter<int32_t>>(0);
+    } else if (type == "uint32") {
+      spec.flag->value = std::make_unique<ValueAdapter<uint32_t>>(0);
+    } else if (type == "uint64") {
+      spec.flag->value = std::make_unique<ValueAdapter<uint64_t>>(0);
+    } else if (type == "float32") {
+      spec.flag->value = std::make_unique<ValueAdapter<float>>(0.0f);
+    } else if (type == "float") {
+      spec.flag->value = std::make_unique<ValueAdapter<double>>(0.0);
+    } else if (type == "bool") {
+      spec.flag->value = std::make_unique<ValueAdapter<bool>>(false);
+    } else if (type == "string") {
+      spec.flag->value = std::make_unique<ValueAdapter<std::string>>("");
+    } else {
+      bad("unknown argument type");
+    }
+    spec.flag->default_value.reset(spec.flag->value->clone());
+    args_.push_back(std::move(spec));
+  }
+}
+
+const Flag *FlagSet::Arg(std::string_view name) const {
+  for (const auto &spec : args_) {
+    if (spec.flag->name == name) {
+      return spec.flag.get();
+    }
+  }
+  return nullptr;
+}
+
+ParseResult FlagSet::Set(std::string_view name, std::string_view value) {
+  auto it = index_.find(name);
+  if (it == index_.end() || it->second->computed) {
+    return ParseResult{ParseErrorKind::UnknownFlag, std::string(name),
+                       "unknown flag: " + std::string(name)};
+  }
+  Flag *flag = it->second;
+  std::string error;
+  size_t offset;
+  bool ok = flag->value->SetWithOffset(value, error, offset);
+  CPPFLAG_PROBE4(flag_update, flag->name.c_str(), value.data(), value.size(),
+                 static_cast<int>(ok));
+  if (!ok) {
+    unset_at_default_ = false;
+    ParseResult pr{ParseErrorKind::InvalidValue, flag->name,
+                   "invalid value for flag '" + flag->name + "': " + error};
+    pr.offset = offset;
+    return pr;
+  }
+  MarkSet(flag);
+  Changed(flag);
+  Invalidate(flag);
+  Recompute();
+  return ParseResult{};
+}
+
+const Flag *FlagSet::Lookup(std::string_view name) const {
+  auto it = index_.find(name);
+  if (it != index_.end()) {
+    return it->second;
+  }
+  return nullptr;
+}
+
+bool FlagSet::IsSet(std::string_view name) const {
+  auto flag = Lookup(name);
+  return flag && flag->set;
+}
+
+void FlagSet::Invalidate(const Flag *flag) {
+  auto it = dependents_.find(flag);
+  if (it == dependents_.end()) {
+    return;
+  }
+  for (size_t c : it->second) {
+    // a dirty flag has already passed the mark on to its dependents
+    if (!computed_[c].dirty) {
+      computed_[c].dirty = true;
+      Invalidate(computed_[c].flag.get());
+    }
+  }
+}
+
+void FlagSet::Recompute() {
+  for (auto &spec : computed_) {
+    if (spec.dirty) {
+      spec.update(*spec.flag);
+      spec.dirty = false;
+      Changed(spec.flag.get());
+      NewGeneration();
+    }
+  }
+}
+
+namespace detail {
+
+/* WorkerPool runs batches of independent tasks on threads that are started
+   on first use and kept for the life of the process. The calling thread
+   works on its own batch as well. One batch runs at a time; a batch that
+   finds the pool busy, for example one started from inside a task, runs
+   on the calling thread alone. */
+class WorkerPool {
+public:
+  explicit WorkerPool(size_t workers) : workers_(workers) {}
+
+  /* Run calls task(i) for every i in [0, n) and returns when all calls are
+     done. */
+  void Run(size_t n, const std::function<void(size_t)> &task) {
+    std::unique_lock<std::mutex> batch(batch_mu_, std::defer_lock);
+    if (n <= 1 || !batch.try_lock() || Forked()) {
+      for (size_t i = 0; i < n; ++i) {
+        task(i);
+      }
+      return;
+    }
+    size_t helpers = std::min(n - 1, workers_);
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      Start();
+      task_ = &task;
+      n_ = n;
+      next_.store(0, std::memory_order_relaxed);
+      tickets_ = helpers;
+      pending_ = helpers;
+    }
+    for (size_t k = 0; k < helpers; ++k) {
+      wake_.notify_one();
+    }
+    Work();
+    std::unique_lock<std::mutex> lock(mu_);
+    done_.wait(lock, [this] { return pending_ == 0; });
+    task_ = nullptr;
+  }
 
 private:
-  T value_;
-  std::string type_name_;
-};
+  // Forked reports whether the workers were started in a parent process and
+  // so do not exist here. Called with batch_mu_ held.
+  bool Forked() const {
+#if defined(__unix__) || defined(__APPLE__)
+    return started_ && pid_ != getpid();
+#else
+    return false;
+#endif
+  }
 
-struct Flag {
-  std::string name;
-  char short_name = 0;
-  std::string usage;
-  std::unique_ptr<IValue> value;
-  std::unique_ptr<IValue> default_value;
-  bool set = false;
+  // Start launches the workers on the first batch. Called with batch_mu_ and
+  // mu_ held.
+  void Start() {
+    if (started_) {
+      return;
+    }
+    started_ = true;
+#if defined(__unix__) || defined(__APPLE__)
+    pid_ = getpid();
+#endif
+    for (size_t k = 0; k < workers_; ++k) {
+      std::thread([this] {
+        std::unique_lock<std::mutex> lock(mu_);
+        for (;;) {
+          wake_.wait(lock, [this] { return tickets_ > 0; });
+          --tickets_;
+          lock.unlock();
+          Work();
+          lock.lock();
+          if (--pending_ == 0) {
+            done_.notify_one();
+          }
+        }
+      }).detach();
+    }
+  }
 
-  /* As returns the value of the flag as type T.
-     It throws std::bad_cast if the type does not match. */
-  template <typename T> const T &As() const {
-    auto va = dynamic_cast<const ValueAdapter<T> *>(value.get());
-    if (!va) {
-      throw std::bad_cast();
+  void Work() {
+    for (size_t i; (i = next_.fetch_add(1, std::memory_order_relaxed)) < n_;) {
+      (*task_)(i);
     }
-    return va->Get();
   }
+
+  const size_t workers_;
+  std::mutex batch_mu_;
+  std::mutex mu_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  bool started_ = false;
+#if defined(__unix__) || defined(__APPLE__)
+  pid_t pid_ = 0;
+#endif
+  const std::function<void(size_t)> *task_ = nullptr;
+  size_t n_ = 0;
+  std::atomic<size_t> next_{0};
+  size_t tickets_ = 0; // workers still to join the batch
+  size_t pending_ = 0; // workers that joined and have not finished
 };
 
-class FlagSet {
-public:
-  /* FlagSet creates a new, empty flag set with the specified name and
-   * description. */
-  explicit FlagSet(std::string name, std::string desc = {});
-  /* Int defines a int64_t flag with specified name, default value, and usage
-   * string. */
-  Flag *Int(std::string_view name, int64_t defaultVal, std::string_view usage,
-            char short_name = 0);
-  /* Float defines a double flag with specified name, default value, and usage
-   * string. */
-  Flag *Float(std::string_view name, double defaultVal, std::string_view usage,
-              char short_name = 0);
-  /* Bool defines a bool flag with specified name, default value, and usage
-   * string. */
-  Flag *Bool(std::string_view name, bool defaultVal, std::string_view usage,
-             char short_name = 0);
-  /* String defines a string flag with specified name, default value, and usage
-   * string. */
-  Flag *String(std::string_view name, std::string_view defaultVal,
-               std::string_view usage, char short_name = 0);
+} // namespace detail
 
-  /* Parse parses flag definitions from the argument list, which should not
-     include the command name. It returns a ParseResult indicating success or
-     failure. */
-  ParseResult Parse(int argc, char **argv);
-  /* Lookup returns the Flag structure for a flag, or nullptr if not found. */
-  const Flag *Lookup(std::string_view name) const;
-  /* IsSet reports whether the flag was set by the user. */
-  bool IsSet(std::string_view name) const;
+void FlagSet::AddValidator(const Flag *flag, Validator fn) {
+  validators_.push_back({flag, std::move(fn)});
+}
 
-  // Usage
-  /* PrintUsage prints a usage message to the given output stream. */
-  void PrintUsage(std::ostream &os) const;
-  /* PrintError prints an error message to the given output stream. */
-  void PrintError(const ParseResult &pr, std::ostream &os) const;
-  /* Positional returns the non-flag arguments. */
-  std::vector<std::string> Positional() const { return positional_; }
+void FlagSet::StrictUtf8(const Flag *flag) {
+  Flag *owned = Owns(flag) ? flags_[flag->id].get() : nullptr;
+  for (auto &spec : args_) {
+    if (spec.flag.get() == flag) {
+      owned = spec.flag.get();
+    }
+  }
+  if (!owned) {
+    detail::DefinitionError(flag->name, "StrictUtf8 on a flag of another set");
+  }
+  for (IValue *v : {owned->value.get(), owned->default_value.get()}) {
+    if (auto *s = dynamic_cast<ValueAdapter<std::string> *>(v)) {
+      s->SetStrictUtf8(true);
+    } else if (auto *ss = dynamic_cast<ValueAdapter<StringSetValue> *>(v)) {
+      ss->SetStrictUtf8(true);
+    } else if (auto *js = dynamic_cast<ValueAdapter<JsonValue> *>(v)) {
+      js->SetStrictUtf8(true);
+    } else {
+      detail::DefinitionError(
+          flag->name, "StrictUtf8 needs a string, string-set or JSON flag");
+    }
+  }
+  if (detail::FindInvalidUtf8(owned->default_value->ToString()) !=
+      std::string_view::npos) {
+    detail::DefinitionError(flag->name, "default value is not valid UTF-8");
+  }
+  // cached parses were converted without the check
+  ClearCache();
+}
 
-private:
-  std::string name_;
-  std::string desc_;
-  std::vector<std::unique_ptr<Flag>> flags_;
-  std::unordered_map<std::string_view, Flag *> index_;
-  std::unordered_map<char, Flag *> short_index_;
-  std::vector<std::string> positional_;
-  template <typename T>
-  Flag *AddFlag(std::string_view name, char short_name, T defaultVal,
-                std::string_view usage);
-};
+ParseResult FlagSet::Validate() {
+  validation_errors_.clear();
+  size_t n = validators_.size();
+  std::vector<std::string> errors(n);
+  std::vector<char> failed(n);
+  // shared by every FlagSet and never destroyed, so that its detached
+  // workers cannot outlive it at exit
+  static detail::WorkerPool *pool =
+      new detail::WorkerPool(kMaxValidatorThreads - 1);
+  pool->Run(n, [&](size_t i) {
+    failed[i] = !validators_[i].fn(*validators_[i].flag, errors[i]);
+  });
 
-FlagSet::FlagSet(std::string name, std::string desc) {
-  name_ = name;
-  desc_ = desc;
-  Bool("help", false, "show this help message", 'h');
+  for (size_t i = 0; i < n; ++i) {
+    if (failed[i]) {
+      const std::string &name = validators_[i].flag->name;
+      validation_errors_.push_back(
+          ParseResult{ParseErrorKind::ValidationFailed, name,
+                      "validation failed for flag '" + name + "': " +
+                          errors[i]});
+    }
+  }
+  return validation_errors_.empty() ? ParseResult{} : validation_errors_[0];
 }
 
-template <typename T>
-Flag *FlagSet::AddFlag(std::string_view name, char short_name, T defaultVal,
-                       std::string_view usage) {
-  auto ptr = std::make_unique<Flag>();
-  ptr->name = name;
-  ptr->usage = usage;
-  ptr->short_name = short_name;
-  auto v_ptr = std::make_unique<ValueAdapter<T>>(defaultVal);
-  ptr->default_value = std::unique_ptr<IValue>(v_ptr->clone());
-  ptr->value = std::move(v_ptr);
-  ptr->set = false;
-  this->flags_.emplace_back(std::move(ptr));
-  Flag *flag_ptr = this->flags_.back().get();
-  this->index_[name] = flag_ptr;
-  if (short_name != 0) {
-    this->short_index_[short_name] = flag_ptr;
+void FlagSet::Reset() {
+  ResetSetValues(nullptr);
+  unset_at_default_ = true;
+  Recompute();
+}
+
+void FlagSet::ResetSetValues(const std::vector<uint64_t> *keep) {
+  if (!unset_at_default_) {
+    ResetValues();
+    return;
+  }
+  NewGeneration();
+  positional_.clear();
+  rest_.clear();
+  validation_errors_.clear();
+  for (size_t w = 0; w < set_bits_.size(); ++w) {
+    uint64_t stale = keep ? set_bits_[w] & ~(*keep)[w] : set_bits_[w];
+    for (; stale != 0; stale &= stale - 1) {
+      Flag *flag = flags_[w * 64 + detail::CountTrailingZeros(stale)].get();
+      flag->value.reset(flag->default_value->clone());
+      flag->set = false;
+      Changed(flag);
+      Invalidate(flag);
+    }
+    set_bits_[w] = 0;
+  }
+  for (const auto &spec : args_) {
+    if (spec.flag->set) {
+      spec.flag->value.reset(spec.flag->default_value->clone());
+      spec.flag->set = false;
+      Changed(spec.flag.get());
+    }
   }
-  return flag_ptr;
 }
 
-Flag *FlagSet::Int(std::string_view name, int64_t defaultVal,
-                   std::string_view usage, char short_name) {
-  return AddFlag<int64_t>(name, short_name, defaultVal, usage);
+void FlagSet::EnableParseCache(size_t capacity) {
+  ClearCache();
+  cache_capacity_ = capacity;
+  cache_.reserve(capacity);
 }
 
-Flag *FlagSet::Float(std::string_view name, double defaultVal,
-                     std::string_view usage, char short_name) {
-  return AddFlag<double>(name, short_name, defaultVal, usage);
+FlagSet::ParseCacheStats FlagSet::CacheStats() const {
+  ParseCacheStats stats = cache_stats_;
+  stats.entries = cache_.size();
+  return stats;
 }
 
-Flag *FlagSet::Bool(std::string_view name, bool defaultVal,
-                    std::string_view usage, char short_name) {
-  return AddFlag<bool>(name, short_name, defaultVal, usage);
+void FlagSet::ClearCache() {
+  cache_.clear();
+  cache_index_.clear();
+  cache_next_ = 0;
 }
 
-Flag *FlagSet::String(std::string_view name, std::string_view defaultVal,
-                      std::string_view usage, char short_name) {
-  return AddFlag<std::string>(name, short_name, std::string(defaultVal), usage);
+uint64_t FlagSet::HashArgs(int argc, char **argv) {
+  uint64_t h = static_cast<uint64_t>(argc);
+  for (int i = 1; i < argc; ++i) {
+    h = detail::HashBytes(argv[i], h);
+  }
+  return h;
 }
 
-/* Parse parses flag definitions from the argument list, which should not
-   include the command name. It returns a ParseResult indicating success or
-   failure. */
-ParseResult FlagSet::Parse(int argc, char **argv) {
-  positional_.clear();
-  bool no_more_flags = false;
+bool FlagSet::ApplyCached(int argc, char **argv, uint64_t hash) {
+  auto it = cache_index_.find(hash);
+  if (it == cache_index_.end()) {
+    ++cache_stats_.misses;
+    return false;
+  }
+  const CachedParse &entry = cache_[it->second];
+  // a hash collision must not return another command line's values
+  size_t pos = 0;
+  for (int i = 1; i < argc; ++i) {
+    size_t len = std::strlen(argv[i]) + 1;
+    if (entry.key.size() - pos < len ||
+        std::memcmp(entry.key.data() + pos, argv[i], len) != 0) {
+      ++cache_stats_.misses;
+      return false;
+    }
+    pos += len;
+  }
+  if (pos != entry.key.size()) {
+    ++cache_stats_.misses;
+    return false;
+  }
+  ++cache_stats_.hits;
 
-  for (const auto &flag : flags_) {
-    flag->value.reset(flag->default_value->clone());
-    flag->set = false;
+  // the flags the entry sets are overwritten anyway
+  ResetSetValues(&entry.set_bits);
+  set_bits_ = entry.set_bits;
+  for (const auto &[flag, value] : entry.flags) {
+    flag->value.reset(value->clone());
+    flag->set = true;
+    Changed(flag);
+    Invalidate(flag);
+  }
+  for (const auto &[flag, value] : entry.args) {
+    flag->value.reset(value->clone());
+    flag->set = true;
+    Changed(flag);
+  }
+  positional_.clear();
+  for (int i : entry.positional) {
+    positional_.emplace_back(argv[i]);
+  }
+  for (int i : entry.rest) {
+    rest_.emplace_back(argv[i]);
   }
+  unset_at_default_ = true;
+  Recompute();
+  return true;
+}
 
+void FlagSet::StoreCached(int argc, char **argv, uint64_t hash) {
+  CachedParse entry;
+  entry.hash = hash;
   for (int i = 1; i < argc; ++i) {
-    std::string arg = argv[i];
-
-    if (arg == "--help" || arg == "-h" || arg == "-help") {
-      return {ParseErrorKind::HelpRequested, "", ""};
+    entry.key.append(argv[i], std::strlen(argv[i]) + 1);
+  }
+  VisitSet([&](const Flag &flag) {
+    entry.flags.emplace_back(const_cast<Flag *>(&flag),
+                             std::unique_ptr<IValue>(flag.value->clone()));
+  });
+  entry.set_bits = set_bits_;
+  for (const auto &spec : args_) {
+    if (spec.flag->set) {
+      entry.args.emplace_back(spec.flag.get(), std::unique_ptr<IValue>(
+                                                   spec.flag->value->clone()));
     }
-
-    if (no_more_flags) {
-      positional_.push_back(arg);
-      continue;
+  }
+  // positionals and variadic arguments are whole argv entries, in order
+  auto indexes = [&](const std::vector<std::string_view> &args,
+                     std::vector<int> &out) {
+    int i = 1;
+    for (std::string_view arg : args) {
+      while (argv[i] != arg.data()) {
+        ++i;
+      }
+      out.push_back(i++);
     }
+  };
+  indexes(positional_, entry.positional);
+  indexes(rest_, entry.rest);
 
-    if (arg == "--") {
-      no_more_flags = true;
-      continue;
+  // a colliding entry is replaced, so every hash maps to one entry
+  auto it = cache_index_.find(hash);
+  if (it != cache_index_.end()) {
+    cache_[it->second] = std::move(entry);
+    return;
+  }
+  size_t slot = cache_.size();
+  if (slot < cache_capacity_) {
+    cache_.push_back(std::move(entry));
+  } else {
+    slot = cache_next_;
+    cache_next_ = (cache_next_ + 1) % cache_capacity_;
+    cache_index_.erase(cache_[slot].hash);
+    cache_[slot] = std::move(entry);
+  }
+  cache_index_[hash] = slot;
+}
+
+void FlagSet::SyncSetBits() {
+  std::fill(set_bits_.begin(), set_bits_.end(), 0);
+  for (const auto &flag : flags_) {
+    if (flag->set) {
+      set_bits_[flag->id >> 6] |= uint64_t(1) << (flag->id & 63);
+      Invalidate(flag.get());
     }
+  }
+}
+
+FlagSetPool::FreeList &FlagSetPool::FreeListOf(uint64_t pool) {
+  // one list per pool and thread; the sets are freed when the thread exits
+  static thread_local std::unordered_map<uint64_t, FreeList> lists;
+  return lists[pool];
+}
+
+FlagSetPool::Lease FlagSetPool::Acquire() {
+  FreeList &free = FreeListOf(id_);
+  Release release{id_, max_free_};
+  if (!free.empty()) {
+    Lease fs(free.back().release(), release);
+    free.pop_back();
+    return fs;
+  }
+  auto fs = std::make_unique<FlagSet>(name_, desc_);
+  define_(*fs);
+  return Lease(fs.release(), release);
+}
+
+void FlagSetPool::Release::operator()(FlagSet *fs) const {
+  std::unique_ptr<FlagSet> owned(fs);
+  FreeList &free = FreeListOf(pool);
+  if (free.size() < max_free) {
+    owned->Reset();
+    free.push_back(std::move(owned));
+  }
+}
+
+void FlagSetStack::Push(FlagSet &fs) {
+  sets_.push_back(&fs);
+  Build();
+}
 
-    // handle positional arguments
-    if (arg[0] != '-') {
-      positional_.push_back(arg);
+ParseResult FlagSetStack::Parse(int argc, char **argv) {
+  assert(!sets_.empty() && "Parse on an empty FlagSetStack");
+  // sets may have gained flags after they were pushed
+  if (FlagCount() != indexed_) {
+    Build();
+  }
+  CPPFLAG_PROBE2(parse_start, argc, argv);
+  for (FlagSet *fs : sets_) {
+    fs->ResetValues();
+  }
+  ParseResult pr = sets_.back()->ParseTokens(argc, argv, index_, short_index_);
+  for (size_t k = 0; k + 1 < sets_.size(); ++k) {
+    sets_[k]->SyncSetBits();
+  }
+  for (FlagSet *fs : sets_) {
+    fs->unset_at_default_ = pr.ok();
+  }
+  for (FlagSet *fs : sets_) {
+    fs->Recompute();
+  }
+  validation_errors_.clear();
+  for (FlagSet *fs : sets_) {
+    if (!pr.ok()) {
+      fs->validation_errors_.clear();
       continue;
     }
+    fs->Validate();
+    validation_errors_.insert(validation_errors_.end(),
+                              fs->validation_errors_.begin(),
+                              fs->validation_errors_.end());
+  }
+  if (!validation_errors_.empty()) {
+    pr = validation_errors_[0];
+  }
+  CPPFLAG_PROBE2(parse_done, static_cast<int>(pr.kind), pr.flag.c_str());
+  return pr;
+}
+
+const Flag *FlagSetStack::Lookup(std::string_view name) const {
+  auto it = index_.find(name);
+  if (it != index_.end()) {
+    return it->second;
+  }
+  return nullptr;
+}
 
-    // handle long options --flag=value or --flag value
-    if (arg.size() > 2 && arg[1] == '-') {
-      std::string flag_name;
-      std::string value;
+void FlagSetStack::PrintUsage(Sink &out) const {
+  for (size_t k = 0; k < sets_.size(); ++k) {
+    if (k != 0) {
+      out.Write("\n");
+    }
+    sets_[k]->PrintUsage(out);
+  }
+}
 
-      size_t equal_pos = arg.find('=');
-      if (equal_pos != std::string::npos) {
-        // --flag=value format
-        flag_name = arg.substr(2, equal_pos - 2);
-        value = arg.substr(equal_pos + 1);
-      } else {
-        // --flag value format
-        flag_name = arg.substr(2);
-        auto it = index_.find(flag_name);
-        if (it != index_.end()) {
-          auto va = dynamic_cast<ValueAdapter<bool> *>(it->second->value.get());
-          if (va) {
-            value = "true";
-          } else if (i + 1 < argc && argv[i + 1][0] != '-') {
-            value = argv[++i];
-          } else {
-            return ParseResult{ParseErrorKind::MissingValue, flag_name,
-                               "flag '" + flag_name + "' needs a value"};
-          }
-        }
-      }
+#if !defined(CPPFLAG_NO_IOSTREAM)
+void FlagSetStack::PrintUsage(std::ostream &os) const {
+  OstreamSink out(os);
+  PrintUsage(out);
+}
+#endif
 
-      auto it = index_.find(flag_name);
-      if (it == index_.end()) {
-        return ParseResult{ParseErrorKind::UnknownFlag, flag_name,
-                           "unknown flag: " + flag_name};
-      }
+size_t FlagSetStack::FlagCount() const {
+  size_t total = 0;
+  for (const FlagSet *fs : sets_) {
+    total += fs->flags_.size();
+  }
+  return total;
+}
 
-      Flag *flag = it->second;
-      std::string error;
-      if (!flag->value->Set(value, error)) {
-        return ParseResult{ParseErrorKind::InvalidValue, flag_name,
-                           "invalid value for flag '" + flag_name +
-                               "': " + error};
-      }
-      flag->set = true;
-    }
-    // handle short options -f value or -fvalue
-    else if (arg.size() > 1 && arg[0] == '-' && arg[1] != '-') {
-      char flag_char = arg[1];
-      auto it = short_index_.find(flag_char);
-      if (it == short_index_.end()) {
-        return ParseResult{ParseErrorKind::UnknownFlag,
-                           std::string(1, flag_char),
-                           "unknown flag: -" + std::string(1, flag_char)};
-      }
-      Flag *flag = it->second;
-      std::string value;
-
-      if (arg.size() > 2) {
-        // -fvalue format
-        value = arg.substr(2);
-      } else {
-        // -f format, value might be next arg, or implicit for bool
-        auto va = dynamic_cast<ValueAdapter<bool> *>(flag->value.get());
-        if (va) {
-          value = "true";
-        } else if (i + 1 < argc) {
-          value = argv[++i];
+void FlagSetStack::Build() {
+  index_.clear();
+  short_index_.clear();
+  indexed_ = FlagCount();
+  index_.reserve(indexed_);
+  // with kInnerWins the sets are visited top first; either way the first
+  // set to claim a name keeps it
+  bool top_first = shadowing_ == Shadowing::kInnerWins;
+  for (size_t k = 0; k < sets_.size(); ++k) {
+    const FlagSet *fs = sets_[top_first ? sets_.size() - 1 - k : k];
+    for (const auto &flag : fs->flags_) {
+      bool added = index_.emplace(flag->name, flag.get()).second;
+      bool short_added =
+          flag->short_name == 0 ||
+          short_index_.emplace(flag->short_name, flag.get()).second;
+      // like a bad Args schema, a duplicate must not slip through release
+      // builds as a silent kInnerWins
+      if ((!added || !short_added) && shadowing_ == Shadowing::kReject &&
+          flag->name != "help") {
+        if (!added) {
+          std::fprintf(stderr,
+                       "cppflag: flag --%s defined in more than one set\n",
+                       flag->name.c_str());
         } else {
-          return ParseResult{ParseErrorKind::MissingValue, flag->name,
-                             "flag '-" + std::string(1, flag_char) +
-                                 "' needs a value"};
+          std::fprintf(stderr,
+                       "cppflag: short flag -%c of --%s defined in more than "
+                       "one set\n",
+                       flag->short_name, flag->name.c_str());
         }
+        std::abort();
       }
+    }
+  }
+}
 
-      std::string error;
-      if (!flag->value->Set(value, error)) {
-        return ParseResult{ParseErrorKind::InvalidValue, flag->name,
-                           "invalid value for flag '-" +
-                               std::string(1, flag_char) + "': " + error};
-      }
-      flag->set = true;
+/* The snapshot starts with an 8 byte magic and the entry count. Each entry is
+   a header of name, type name and value lengths followed by those bytes. All
+   integers are little-endian uint32_t. Numeric values are their raw bytes in
+   little-endian order; other values are their ToString text. */
+namespace detail {
+
+constexpr char kSnapshotMagic[8] = {'C', 'F', 'L', 'G', 'S', 'N', 'P', '1'};
+
+inline void PutU32(std::string &out, uint32_t v) {
+  char b[4] = {static_cast<char>(v), static_cast<char>(v >> 8),
+               static_cast<char>(v >> 16), static_cast<char>(v >> 24)};
+  out.append(b, 4);
+}
+
+inline bool GetU32(std::string_view &in, uint32_t &v) {
+  if (in.size() < 4) {
+    return false;
+  }
+  auto b = reinterpret_cast<const unsigned char *>(in.data());
+  v = b[0] | (b[1] << 8) | (b[2] << 16) | (uint32_t(b[3]) << 24);
+  in.remove_prefix(4);
+  return true;
+}
+
+} // namespace detail
+
+std::string FlagSet::Snapshot(std::string &err) const {
+  std::string out(detail::kSnapshotMagic, sizeof(detail::kSnapshotMagic));
+  size_t count_pos = out.size();
+  detail::PutU32(out, 0);
+  uint32_t count = 0;
+  std::string value;
+  const Flag *too_long = nullptr;
+  VisitSet([&](const Flag &flag) {
+    if (too_long) {
+      return;
+    }
+    std::string type = flag.value->TypeName();
+    value.clear();
+    flag.value->Encode(value);
+    if (flag.name.size() > UINT32_MAX || type.size() > UINT32_MAX ||
+        value.size() > UINT32_MAX) {
+      too_long = &flag;
+      return;
+    }
+    detail::PutU32(out, flag.name.size());
+    detail::PutU32(out, type.size());
+    detail::PutU32(out, value.size());
+    out += flag.name;
+    out += type;
+    out += value;
+    ++count;
+  });
+  if (too_long) {
+    err = "flag --" + too_long->name + ": value too long for a snapshot";
+    return std::string();
+  }
+  std::string n;
+  detail::PutU32(n, count);
+  out.replace(count_pos, 4, n);
+  return out;
+}
+
+ParseResult FlagSet::AdoptSnapshot(std::string_view data) {
+  auto fail = [](std::string flag, std::string msg) {
+    return ParseResult{ParseErrorKind::InvalidSnapshot, std::move(flag),
+                       "invalid snapshot: " + std::move(msg)};
+  };
+  std::string_view magic(detail::kSnapshotMagic,
+                         sizeof(detail::kSnapshotMagic));
+  if (data.substr(0, magic.size()) != magic) {
+    return fail("", "bad magic");
+  }
+  data.remove_prefix(magic.size());
+  uint32_t count;
+  if (!detail::GetU32(data, count)) {
+    return fail("", "truncated");
+  }
+
+  // decode everything into copies before touching any flag
+  struct Entry {
+    Flag *flag;
+    std::unique_ptr<IValue> value;
+  };
+  std::vector<Entry> entries;
+  // count is untrusted; every entry takes at least its 12 header bytes
+  entries.reserve(std::min<size_t>(count, data.size() / 12));
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t name_len, type_len, value_len;
+    if (!detail::GetU32(data, name_len) || !detail::GetU32(data, type_len) ||
+        !detail::GetU32(data, value_len) ||
+        uint64_t(name_len) + type_len + value_len > data.size()) {
+      return fail("", "truncated");
+    }
+    std::string_view name = data.substr(0, name_len);
+    std::string_view type = data.substr(name_len, type_len);
+    std::string_view value = data.substr(name_len + type_len, value_len);
+    data.remove_prefix(name_len + type_len + value_len);
+    auto it = index_.find(name);
+    if (it == index_.end() || it->second->computed) {
+      return fail(std::string(name), "unknown flag: " + std::string(name));
+    }
+    if (it->second->value->TypeName() != type) {
+      return fail(std::string(name), "type mismatch for flag '" +
+                                         std::string(name) + "'");
     }
+    std::unique_ptr<IValue> decoded(it->second->value->clone());
+    std::string error;
+    size_t offset;
+    if (!decoded->DecodeWithOffset(value, error, offset)) {
+      ParseResult pr =
+          fail(it->second->name, "flag '" + it->second->name + "': " + error);
+      pr.offset = offset;
+      return pr;
+    }
+    entries.push_back({it->second, std::move(decoded)});
+  }
+  if (!data.empty()) {
+    return fail("", "trailing data");
   }
 
+  ResetValues();
+  for (auto &e : entries) {
+    e.flag->value = std::move(e.value);
+    MarkSet(e.flag);
+    Changed(e.flag);
+    Invalidate(e.flag);
+  }
+  Recompute();
   return ParseResult{};
 }
 
-const Flag *FlagSet::Lookup(std::string_view name) const {
-  auto it = index_.find(name);
-  if (it != index_.end()) {
-    return it->second;
+#if defined(__linux__)
+int FlagSet::ExportMemfd(std::string &err) const {
+  std::string snap = Snapshot(err);
+  if (snap.empty()) {
+    return -1;
   }
-  return nullptr;
+  int fd = memfd_create("cppflag-snapshot", MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    err = std::string("memfd_create: ") + std::strerror(errno);
+    return -1;
+  }
+  size_t off = 0;
+  while (off < snap.size()) {
+    ssize_t n = write(fd, snap.data() + off, snap.size() - off);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      err = std::string("write: ") + std::strerror(errno);
+      close(fd);
+      return -1;
+    }
+    off += static_cast<size_t>(n);
+  }
+  if (fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+    err = std::string("seal: ") + std::strerror(errno);
+    close(fd);
+    return -1;
+  }
+  return fd;
 }
 
-bool FlagSet::IsSet(std::string_view name) const {
-  auto flag = Lookup(name);
-  return flag && flag->set;
+ParseResult FlagSet::AdoptMemfd(int fd) {
+  auto fail = [](std::string msg) {
+    return ParseResult{ParseErrorKind::InvalidSnapshot, "",
+                       "invalid snapshot: " + std::move(msg)};
+  };
+  int seals = fcntl(fd, F_GET_SEALS);
+  constexpr int kRequired = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+  if (seals < 0 || (seals & kRequired) != kRequired) {
+    return fail("descriptor is not a sealed memfd");
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+    return fail("cannot stat descriptor");
+  }
+  size_t size = static_cast<size_t>(st.st_size);
+  void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED) {
+    return fail(std::string("mmap: ") + std::strerror(errno));
+  }
+  ParseResult pr =
+      AdoptSnapshot(std::string_view(static_cast<const char *>(p), size));
+  munmap(p, size);
+  return pr;
 }
+#endif
 
-void FlagSet::PrintUsage(std::ostream &os) const {
-  os << "Usage: " << name_;
+void FlagSet::PrintUsage(Sink &out) const {
+  // the message is written in one piece
+  std::string text = "Usage: " + name_;
   if (!flags_.empty()) {
-    os << " [flags]";
+    text += " [flags]";
+  }
+  if (!args_schema_.empty()) {
+    text += " " + args_schema_;
   }
-  os << "\n";
+  text += "\n";
 
   if (!desc_.empty()) {
-    os << desc_ << "\n";
+    text += desc_ + "\n";
   }
 
   if (!flags_.empty()) {
-    os << "\nFlags:\n";
+    text += "\nFlags:\n";
     for (const auto &flag : flags_) {
-      os << "  ";
+      text += "  ";
       if (flag->short_name != 0) {
-        os << "-" << flag->short_name << ", ";
+        text += "-";
+        text += flag->short_name;
+        text += ", ";
       }
-      os << "--" << flag->name;
-      os << "\t" << flag->usage
-         << " (default: " << flag->default_value->ToString() << ")\n";
+      text += "--" + flag->name;
+      text += "\t" + flag->usage +
+              " (default: " + flag->default_value->ToString() + ")\n";
+    }
+  }
+  if (!computed_.empty()) {
+    // derived from other flags, so there is nothing to pass
+    text += "\nComputed:\n";
+    for (const auto &spec : computed_) {
+      text += "  " + spec.flag->name + "\t" + spec.flag->usage + "\n";
     }
   }
+  out.Write(text);
+}
+
+void FlagSet::PrintError(const ParseResult &pr, Sink &out) const {
+  out.Write("error: " + pr.message);
+}
+
+#if !defined(CPPFLAG_NO_IOSTREAM)
+void FlagSet::PrintUsage(std::ostream &os) const {
+  OstreamSink out(os);
+  PrintUsage(out);
 }
 
 void FlagSet::PrintError(const ParseResult &pr, std::ostream &os) const {
-  os << "error: " << pr.message;
+  OstreamSink out(os);
+  PrintError(pr, out);
 }
+#endif
 
 /* Get returns the value of the flag with the given name from the flag set.
    It returns a zero value if the flag is not found. */
@@ -410,4 +4353,43 @@ template <typename T> T Get(const FlagSet &fs, std::string_view name) {
   return T{};
 }
 
+/* CachedGet resolves a flag name once per FlagSet generation and then reads
+   the value through the resolved slot, without hashing, dynamic_cast or
+   copying. It returns a zero value if the flag is not found. One instance
+   serves one call site and one thread; see CLI_GET. */
+template <typename T> class CachedGet {
+public:
+  explicit CachedGet(std::string_view name) : name_(name) {}
+
+  /* Get returns the value of the flag in fs. The reference stays valid until
+     fs.Generation() changes. */
+  const T &Get(const FlagSet &fs) {
+    if (generation_ != fs.Generation()) {
+      Resolve(fs);
+    }
+    return *value_;
+  }
+
+private:
+  void Resolve(const FlagSet &fs) {
+    static const T zero{};
+    const Flag *flag = fs.Lookup(name_);
+    value_ = flag ? &flag->As<T>() : &zero;
+    generation_ = fs.Generation();
+  }
+
+  std::string_view name_;
+  uint64_t generation_ = 0; // never a FlagSet generation
+  const T *value_ = nullptr;
+};
+
 } // namespace cli
+
+/* CLI_GET(T, fs, name) is a drop-in replacement for cli::Get<T>(fs, name)
+   with a per-call-site, per-thread CachedGet. name must be a constant, such
+   as a string literal. It returns const T &. */
+#define CLI_GET(T, fs, name)                                                   \
+  ([](const ::cli::FlagSet &cli_fs_) -> const T & {                            \
+    static thread_local ::cli::CachedGet<T> cli_slot_(name);                   \
+    return cli_slot_.Get(cli_fs_);                                             \
+  }(fs))
@@ -0,0 +1,132 @@
+#include "../cppflag.hpp"
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Performance fuzzer for FlagSet::Parse. The input is split on NUL bytes into
+// argv tokens. Each run measures parse cost in nanoseconds per input byte and
+// reports its log2 bucket to libFuzzer as an extra coverage counter. Inputs
+// that reach a new, higher cost bucket are therefore kept in the corpus, and
+// the search drifts towards superlinear inputs. An input whose cost exceeds
+// the budget aborts, so libFuzzer saves it as a crash.
+//
+// Fuzzing (clang):
+//   clang++ -std=c++17 -O2 -g -fsanitize=fuzzer
+//       fuzz/parse_cost_fuzzer.cpp -o parse_cost_fuzzer
+//   ./parse_cost_fuzzer -max_len=65536 fuzz/corpus
+//
+// Replaying the regression corpus with time budgets (any compiler):
+//   g++ -std=c++17 -O2 -DCPPFLAG_FUZZ_REPLAY
+//       fuzz/parse_cost_fuzzer.cpp -o parse_cost_replay
+//   ./parse_cost_replay fuzz/corpus/*
+// or, building and replaying in one step with a hard timeout per input:
+//   fuzz/replay_corpus.sh
+
+namespace {
+
+// budget for one parse: a fixed allowance plus a linear per-byte allowance
+constexpr double kBaseBudgetNs = 200000;
+constexpr double kPerByteBudgetNs = 100;
+
+cli::FlagSet &Target() {
+  static cli::FlagSet *fs = [] {
+    auto f = new cli::FlagSet("fuzz");
+    f->Int("port", 8080, "port", 'p');
+    f->Int32("workers", 4, "workers", 'w');
+    f->UInt64("limit", 0, "limit");
+    f->Float("ratio", 1.0, "ratio", 'r');
+    f->Bool("debug", false, "debug", 'd');
+    f->String("mode", "fast", "mode", 'm');
+    f->StringSet("allow", "", "allowlist", 'a');
+    f->Features("features", {"fast_path", "compression", "tracing"}, "",
+                "features", 'f');
+    f->Args("[src:string] [count:int] [files:string...]");
+    return f;
+  }();
+  return *fs;
+}
+
+// Cost parses the input once and returns the elapsed nanoseconds.
+double Cost(const uint8_t *data, size_t size) {
+  // the trailing NUL terminates the last token
+  std::string buf(reinterpret_cast<const char *>(data), size);
+  buf.push_back('\0');
+  std::vector<char *> argv;
+  argv.push_back(const_cast<char *>("fuzz"));
+  size_t start = 0;
+  for (size_t i = 0; i < buf.size(); ++i) {
+    if (buf[i] == '\0') {
+      argv.push_back(&buf[start]);
+      start = i + 1;
+    }
+  }
+  auto t0 = std::chrono::steady_clock::now();
+  cli::ParseResult pr =
+      Target().Parse(static_cast<int>(argv.size()), argv.data());
+  auto t1 = std::chrono::steady_clock::now();
+  (void)pr;
+  return std::chrono::duration<double, std::nano>(t1 - t0).count();
+}
+
+double Budget(size_t size) { return kBaseBudgetNs + kPerByteBudgetNs * size; }
+
+} // namespace
+
+#if !defined(CPPFLAG_FUZZ_REPLAY)
+
+// one counter per log2 bucket of ns per byte
+__attribute__((section("__libfuzzer_extra_counters"))) static uint8_t
+    cost_buckets[32];
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  double ns = Cost(data, size);
+  double per_byte = ns / static_cast<double>(size + 1);
+  unsigned bucket = 0;
+  while (per_byte >= 2 && bucket < 31) {
+    per_byte /= 2;
+    ++bucket;
+  }
+  cost_buckets[bucket] = 1;
+  if (ns > Budget(size) && Cost(data, size) > Budget(size)) {
+    std::fprintf(stderr, "parse cost %.0f ns for %zu bytes exceeds budget\n",
+                 ns, size);
+    std::abort();
+  }
+  return 0;
+}
+
+#else
+
+int main(int argc, char **argv) {
+  int failures = 0;
+  for (int i = 1; i < argc; ++i) {
+    std::FILE *f = std::fopen(argv[i], "rb");
+    if (!f) {
+      std::perror(argv[i]);
+      ++failures;
+      continue;
+    }
+    std::vector<uint8_t> data;
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = std::fread(chunk, 1, sizeof(chunk), f)) > 0) {
+      data.insert(data.end(), chunk, chunk + n);
+    }
+    std::fclose(f);
+
+    // the best of a few runs keeps scheduler noise out of the verdict
+    double best = 1e30;
+    for (int r = 0; r < 5; ++r) {
+      best = std::min(best, Cost(data.data(), data.size()));
+    }
+    bool ok = best <= Budget(data.size());
+    std::printf("%-4s %s: %zu bytes, %.0f ns (budget %.0f ns)\n",
+                ok ? "ok" : "SLOW", argv[i], data.size(), best,
+                Budget(data.size()));
+    failures += !ok;
+  }
+  return failures == 0 ? 0 : 1;
+}
+
+#endif
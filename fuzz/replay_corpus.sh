@@ -0,0 +1,40 @@
+#!/bin/sh
+# replay_corpus.sh - replay the parse cost regression corpus.
+#
+# Builds fuzz/parse_cost_fuzzer.cpp in replay mode and runs every input in
+# fuzz/corpus against its time budget (a fixed allowance plus a per-byte
+# one, see the fuzzer). Exits non-zero if any input runs over budget, or
+# if it is still running after a hard limit of TIMEOUT seconds (default 10).
+#
+#   fuzz/replay_corpus.sh            # uses $CXX, or c++
+#   CXX=clang++ fuzz/replay_corpus.sh
+
+set -u
+here=$(cd "$(dirname "$0")" && pwd)
+cxx=${CXX:-c++}
+limit=${TIMEOUT:-10}
+bin=$(mktemp "${TMPDIR:-/tmp}/parse_cost_replay.XXXXXX") || exit 1
+trap 'rm -f "$bin"' EXIT
+
+if ! "$cxx" -std=c++17 -O2 -DCPPFLAG_FUZZ_REPLAY \
+    "$here/parse_cost_fuzzer.cpp" -o "$bin"; then
+  echo "replay_corpus: build failed" >&2
+  exit 1
+fi
+
+failures=0
+for input in "$here"/corpus/*; do
+  timeout "$limit" "$bin" "$input"
+  case $? in
+  0) ;;
+  124)
+    echo "HANG $input: still running after ${limit}s"
+    failures=$((failures + 1))
+    ;;
+  *) failures=$((failures + 1)) ;;
+  esac
+done
+if [ "$failures" -ne 0 ]; then
+  echo "replay_corpus: $failures input(s) over budget" >&2
+  exit 1
+fi
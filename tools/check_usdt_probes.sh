@@ -0,0 +1,59 @@
+#!/bin/sh
+# check_usdt_probes.sh - verify that the USDT probes are compiled in.
+#
+# Builds a small program against cppflag.hpp with -DCPPFLAG_USDT and checks
+# with readelf -n that the binary carries a cppflag probe note for every
+# probe the header defines. Skips (exit 0) when <sys/sdt.h> is not
+# installed, since the probes then compile to nothing.
+#
+#   tools/check_usdt_probes.sh       # uses $CXX, or c++, and $CXXFLAGS
+
+set -u
+here=$(cd "$(dirname "$0")/.." && pwd)
+cxx=${CXX:-c++}
+flags=${CXXFLAGS:-}
+probes="parse_start parse_done flag_set flag_invalid flag_update"
+dir=$(mktemp -d "${TMPDIR:-/tmp}/cppflag_usdt.XXXXXX") || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+if ! printf '#include <sys/sdt.h>\n' |
+    "$cxx" $flags -x c++ -fsyntax-only - 2>/dev/null; then
+  echo "SKIP: <sys/sdt.h> not found (install systemtap-sdt-dev)"
+  exit 0
+fi
+if ! command -v readelf >/dev/null 2>&1; then
+  echo "SKIP: readelf not found"
+  exit 0
+fi
+
+# every probe site lives in a function this program calls
+cat >"$dir/probes.cpp" <<'SRC'
+#include "cppflag.hpp"
+int main(int argc, char **argv) {
+  cli::FlagSet fs("probes");
+  fs.Int("port", 8080, "port");
+  fs.Parse(argc, argv);
+  fs.Set("port", "not a number");
+  return 0;
+}
+SRC
+if ! "$cxx" $flags -std=c++17 -O2 -DCPPFLAG_USDT -I"$here" "$dir/probes.cpp" \
+    -o "$dir/probes"; then
+  echo "FAIL: build with -DCPPFLAG_USDT failed"
+  exit 1
+fi
+
+# readelf prints "Provider: cppflag" followed by "Name: <probe>"
+found=$(readelf -n "$dir/probes" |
+  awk '/Provider:/ { p = $2 } /Name:/ && p == "cppflag" { print $2 }' |
+  sort -u)
+status=0
+for probe in $probes; do
+  if echo "$found" | grep -qx "$probe"; then
+    echo "ok   $probe"
+  else
+    echo "MISSING $probe"
+    status=1
+  fi
+done
+exit $status